@@ -1,5 +1,5 @@
 /*gcc Lbeacon.c -g -o Lbeacon -I libxbee3/include/ -L libxbee3/lib/ -lxbee -lrt
- * -lpthread -lbluetooth -lobexftp*/
+ * -lpthread -lbluetooth -lobexftp -lm*/
 /*
  * Copyright (c) 2016 Academia Sinica, Institude of Information Science
  *
@@ -36,6 +36,452 @@
  */
 
 #include "Lbeacon.h"
+/*********************************************************************
+ * @fn      packet_crc
+ *
+ * @brief   CRC-16/CCITT (polynomial 0x1021) of a block, four bits at a
+ *          time so the table stays small.
+ *
+ * @param   crc - CRC of the previous blocks, 0xFFFF for the first
+ *          data - block of bytes
+ *          len - length of the block
+ *
+ * @return  CRC including this block
+ */
+unsigned short packet_crc(unsigned short crc,
+                          const unsigned char* data,
+                          int len) {
+  static const unsigned short table[16] = {
+      0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+      0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+  int i;
+
+  for (i = 0; i < len; i++) {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+//  CRC of a frame: header up to the crc field, then the data
+static unsigned short packet_frame_crc(struct Packet* frame) {
+  unsigned short crc = packet_crc(0xFFFF, (unsigned char*)frame,
+                                  offsetof(struct Packet, crc));
+  return packet_crc(crc, frame->data, frame->data_len);
+}
+
+/*********************************************************************
+ * @fn      packet_encode
+ *
+ * @brief   Build one ZigBee frame of a message in place.
+ *
+ * @param   frame - frame to fill
+ *          cmd - command of the message
+ *          seq - sequence number of the message
+ *          frag_index - index of this frame in the message
+ *          frag_count - number of frames of the message
+ *          data - payload of this frame
+ *          len - length of the payload, at most PACKET_DATA_SIZE
+ *
+ * @return  Number of bytes of the frame to send
+ */
+int packet_encode(struct Packet* frame,
+                  unsigned char cmd,
+                  unsigned int seq,
+                  int frag_index,
+                  int frag_count,
+                  const unsigned char* data,
+                  int len) {
+  unsigned short crc;
+
+  frame->CMD = cmd;
+  frame->version = PACKET_VERSION;
+  frame->seq[0] = (seq >> 8) & 0xFF;
+  frame->seq[1] = seq & 0xFF;
+  frame->frag_index = frag_index;
+  frame->frag_count = frag_count;
+  frame->data_len = len;
+  if (len > 0)
+    memcpy(frame->data, data, len);
+  crc = packet_frame_crc(frame);
+  frame->crc[0] = crc >> 8;
+  frame->crc[1] = crc & 0xFF;
+  return PACKET_HEADER_SIZE + len;
+}
+
+/*********************************************************************
+ * @fn      packet_decode
+ *
+ * @brief   Check a received ZigBee frame in place, without copying.
+ *          Every frame but the last one of a message carries a full
+ *          PACKET_DATA_SIZE payload.
+ *
+ * @param   buf - received bytes
+ *          len - number of received bytes
+ *
+ * @return  The frame, NULL when it is not a valid frame
+ */
+struct Packet* packet_decode(unsigned char* buf, int len) {
+  struct Packet* frame = (struct Packet*)buf;
+
+  if (len < (int)PACKET_HEADER_SIZE) {
+    packet_stats.bad_length++;
+    return NULL;
+  }
+  if (frame->version != PACKET_VERSION) {
+    packet_stats.bad_version++;
+    return NULL;
+  }
+  if (frame->data_len > PACKET_DATA_SIZE ||
+      len != (int)PACKET_HEADER_SIZE + frame->data_len ||
+      frame->frag_count == 0 || frame->frag_count > PACKET_MAX_FRAGMENTS ||
+      frame->frag_index >= frame->frag_count ||
+      (frame->frag_index + 1 < frame->frag_count &&
+       frame->data_len != PACKET_DATA_SIZE)) {
+    packet_stats.bad_length++;
+    return NULL;
+  }
+  if (packet_frame_crc(frame) != (frame->crc[0] << 8 | frame->crc[1])) {
+    packet_stats.bad_crc++;
+    return NULL;
+  }
+  return frame;
+}
+
+//  Check and remember the last message of a sender
+static int packet_is_duplicate(struct xbee_conAddress* address,
+                               unsigned int seq) {
+  PacketSender* sender = NULL;
+  int i;
+
+  for (i = 0; i < PACKET_SENDERS && sender == NULL; i++)
+    if (packet_senders[i].used &&
+        memcmp(packet_senders[i].addr64, address->addr64, 8) == 0)
+      sender = &packet_senders[i];
+  if (sender != NULL && sender->seq == seq) {
+    packet_stats.duplicates++;
+    return 1;
+  }
+  if (sender == NULL) {
+    //  A new sender takes the place of the first one
+    for (i = 0; i < PACKET_SENDERS - 1 && packet_senders[i].used; i++)
+      ;
+    sender = &packet_senders[i];
+    memcpy(sender->addr64, address->addr64, 8);
+    sender->used = 1;
+  }
+  sender->seq = seq;
+  return 0;
+}
+
+static void packet_dispatch(PacketHandler* handlers,
+                            PacketContext* ctx,
+                            unsigned char cmd,
+                            unsigned char* data,
+                            int len) {
+  if (handlers[cmd] == NULL) {
+    packet_stats.unknown++;
+    return;
+  }
+  handlers[cmd](ctx, data, len);
+}
+
+//  Put a frame into its message, return the message once complete
+static Reassembly* packet_reassemble(struct Packet* frame,
+                                     struct xbee_conAddress* address,
+                                     unsigned int seq) {
+  long long now = getSystemTime();
+  Reassembly* slot = NULL;
+  Reassembly* oldest = &reassembly[0];
+  int i;
+
+  for (i = 0; i < REASSEMBLY_SLOTS; i++) {
+    Reassembly* entry = &reassembly[i];
+    if (entry->used && now - entry->started > REASSEMBLY_TIMEOUT) {
+      entry->used = 0;
+      packet_stats.timeouts++;
+    }
+    if (entry->used && entry->seq == seq &&
+        memcmp(entry->addr64, address->addr64, 8) == 0)
+      slot = entry;
+    if (!entry->used || (oldest->used && entry->started < oldest->started))
+      oldest = entry;
+  }
+  if (slot == NULL) {
+    if (oldest->used)
+      packet_stats.timeouts++;
+    slot = oldest;
+    memcpy(slot->addr64, address->addr64, 8);
+    slot->seq = seq;
+    slot->cmd = frame->CMD;
+    slot->frag_count = frame->frag_count;
+    slot->received = 0;
+    slot->length = 0;
+    slot->started = now;
+    slot->used = 1;
+  }
+  if (slot->frag_count != frame->frag_count || slot->cmd != frame->CMD) {
+    packet_stats.bad_length++;
+    return NULL;
+  }
+  if (slot->received & (1u << frame->frag_index))
+    return NULL;
+
+  memcpy(slot->data + frame->frag_index * PACKET_DATA_SIZE, frame->data,
+         frame->data_len);
+  slot->received |= 1u << frame->frag_index;
+  if (frame->frag_index + 1 == frame->frag_count)
+    slot->length = frame->frag_index * PACKET_DATA_SIZE + frame->data_len;
+  if (slot->received != (1u << slot->frag_count) - 1)
+    return NULL;
+  slot->used = 0;
+  return slot;
+}
+
+/*********************************************************************
+ * @fn      packet_receive
+ *
+ * @brief   Check a frame received from ZigBee, reassemble messages of
+ *          several frames, drop duplicates and call the handler of the
+ *          command. A message of one frame is handed to its handler in
+ *          place. Short unframed commands of older gateways are
+ *          accepted while zigbee_legacy is set.
+ *
+ * @param   handlers - handler of each command, indexed by CMD
+ *          buf - received bytes
+ *          len - number of received bytes
+ *          address - ZigBee address of the sender
+ *
+ * @return  none
+ */
+void packet_receive(PacketHandler* handlers,
+                    unsigned char* buf,
+                    int len,
+                    struct xbee_conAddress* address) {
+  PacketContext ctx;
+  struct Packet* frame;
+  Reassembly* message;
+
+  if (len <= 0)
+    return;
+  pthread_mutex_lock(&packet_lock);
+  ctx.address = *address;
+  ctx.version = 0;
+  ctx.seq = 0;
+  if (len < (int)PACKET_HEADER_SIZE && zigbee_legacy &&
+      handlers[buf[0]] != NULL) {
+    packet_stats.legacy++;
+    handlers[buf[0]](&ctx, buf + 1, len - 1);
+    pthread_mutex_unlock(&packet_lock);
+    return;
+  }
+
+  frame = packet_decode(buf, len);
+  if (frame == NULL) {
+    pthread_mutex_unlock(&packet_lock);
+    return;
+  }
+  packet_stats.frames++;
+  ctx.version = frame->version;
+  ctx.seq = frame->seq[0] << 8 | frame->seq[1];
+
+  if (frame->frag_count == 1) {
+    if (!packet_is_duplicate(address, ctx.seq)) {
+      packet_stats.messages++;
+      packet_dispatch(handlers, &ctx, frame->CMD, frame->data,
+                      frame->data_len);
+    }
+  } else {
+    packet_stats.fragments++;
+    message = packet_reassemble(frame, address, ctx.seq);
+    if (message != NULL && !packet_is_duplicate(address, ctx.seq)) {
+      packet_stats.messages++;
+      packet_dispatch(handlers, &ctx, message->cmd, message->data,
+                      message->length);
+    }
+  }
+  pthread_mutex_unlock(&packet_lock);
+}
+
+/*********************************************************************
+ * @fn      zigbee_transmit
+ *
+ * @brief   Send a message on a ZigBee connection, split into frames
+ *          of PACKET_DATA_SIZE bytes. Called with gateway_lock held.
+ *
+ * @param   target - connection to the gateway
+ *          cmd - command of the message
+ *          data - payload of the message
+ *          len - length of the payload, at most PACKET_MAX_MESSAGE
+ *
+ * @return  0: success
+ *          -1: send failed
+ */
+int zigbee_transmit(struct xbee_con* target,
+                    unsigned char cmd,
+                    const unsigned char* data,
+                    int len) {
+  struct Packet frame;
+  int count = len > 0 ? (len + PACKET_DATA_SIZE - 1) / PACKET_DATA_SIZE : 1;
+  int i, size, ret = 0;
+
+  for (i = 0; i < count && ret == 0; i++) {
+    int chunk = len - i * PACKET_DATA_SIZE;
+    if (chunk > PACKET_DATA_SIZE)
+      chunk = PACKET_DATA_SIZE;
+    size = packet_encode(&frame, cmd, packet_tx_seq, i, count,
+                         data + i * PACKET_DATA_SIZE, chunk);
+    if (xbee_connTx(target, NULL, (unsigned char*)&frame, size) != XBEE_ENONE)
+      ret = -1;
+    else
+      __sync_add_and_fetch(&packet_stats.sent_frames, 1);
+  }
+  packet_tx_seq = (packet_tx_seq + 1) & 0xFFFF;
+  //  Sent under gateway_lock, counted atomically since the rest of
+  //  packet_stats is under packet_lock
+  if (ret == 0)
+    __sync_add_and_fetch(&packet_stats.sent_messages, 1);
+  else
+    __sync_add_and_fetch(&packet_stats.send_errors, 1);
+  return ret;
+}
+
+//  Keep a message for the gateway, dropping the oldest when full
+static void outbox_push(unsigned char cmd, const unsigned char* data, int len) {
+  OutboxEntry* entry;
+
+  if (outbox_count == OUTBOX_SIZE) {
+    outbox_first = (outbox_first + 1) % OUTBOX_SIZE;
+    outbox_count--;
+    outbox_dropped++;
+  }
+  entry = &outbox[(outbox_first + outbox_count) % OUTBOX_SIZE];
+  entry->cmd = cmd;
+  entry->len = len;
+  if (len > 0)
+    memcpy(entry->data, data, len);
+  outbox_count++;
+}
+
+//  Resend the kept messages in order, stop at the first failure
+static void outbox_flush() {
+  OutboxEntry* entry;
+
+  while (outbox_count > 0 && g_con != NULL) {
+    entry = &outbox[outbox_first];
+    if (zigbee_transmit(g_con, entry->cmd, entry->data, entry->len) < 0)
+      return;
+    outbox_first = (outbox_first + 1) % OUTBOX_SIZE;
+    outbox_count--;
+    outbox_resent++;
+  }
+}
+
+/*********************************************************************
+ * @fn      zigbee_send
+ *
+ * @brief   Send a message to the bound gateway, after the messages
+ *          kept in the outbox. While no gateway is bound, a failover
+ *          is in progress or sending fails, the message is kept in the
+ *          outbox and resent in order with the next message or once
+ *          the gateway is heard again.
+ *
+ * @param   cmd - command of the message
+ *          data - payload of the message
+ *          len - length of the payload, at most PACKET_MAX_MESSAGE
+ *
+ * @return  0: sent or kept for later
+ *          -1: message too long
+ */
+int zigbee_send(unsigned char cmd, const unsigned char* data, int len) {
+  if (len > PACKET_MAX_MESSAGE)
+    return -1;
+  pthread_mutex_lock(&gateway_lock);
+  if (g_con != NULL && failover_started == 0)
+    outbox_flush();
+  if (g_con == NULL || failover_started > 0 || outbox_count > 0 ||
+      zigbee_transmit(g_con, cmd, data, len) < 0)
+    outbox_push(cmd, data, len);
+  pthread_mutex_unlock(&gateway_lock);
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      zigbee_reply
+ *
+ * @brief   Answer a received message, unframed when the request came
+ *          from an older gateway.
+ *
+ * @param   ctx - sender and framing of the request
+ *          cmd - command of the answer
+ *          data - payload of the answer
+ *          len - length of the payload
+ *
+ * @return  0: success
+ *          -1: send failed
+ */
+int zigbee_reply(PacketContext* ctx,
+                 unsigned char cmd,
+                 const unsigned char* data,
+                 int len) {
+  unsigned char legacy[1 + PACKET_DATA_SIZE];
+  int ret;
+
+  if (ctx->version != 0)
+    return zigbee_send(cmd, data, len);
+  if (len > PACKET_DATA_SIZE)
+    return -1;
+  legacy[0] = cmd;
+  if (len > 0)
+    memcpy(legacy + 1, data, len);
+  pthread_mutex_lock(&gateway_lock);
+  ret = g_con != NULL && xbee_connTx(g_con, NULL, legacy, 1 + len) ==
+                             XBEE_ENONE
+            ? 0
+            : -1;
+  pthread_mutex_unlock(&gateway_lock);
+  return ret;
+}
+
+//  'r': Response health message to Gateway
+static void handle_health(PacketContext* ctx, unsigned char* data, int len) {
+  //  The data of the request comes back, so the gateway can match them
+  zigbee_reply(ctx, CMD_HEALTH_REPLY, data, len);
+}
+
+//  'b': Bind ZigBee connction with Gateway
+static void handle_bind(PacketContext* ctx, unsigned char* data, int len) {
+  bind_gateway(ctx->address);
+}
+
+//  'h': Heartbeat answer, the gateway was already noted as heard
+static void handle_heartbeat(PacketContext* ctx,
+                             unsigned char* data,
+                             int len) {}
+
+//  'd': Devices pushed by a neighbour LBeacon, relayed by the gateway
+static void handle_suppress_delta(PacketContext* ctx,
+                                  unsigned char* data,
+                                  int len) {
+  suppress_merge_delta(data, len);
+}
+
+//  'f': Filter of the devices pushed by a neighbour LBeacon
+static void handle_suppress_filter(PacketContext* ctx,
+                                   unsigned char* data,
+                                   int len) {
+  suppress_merge_filter(data, len);
+}
+
+//  Handler of each command from the gateway, 's' is not handled yet
+PacketHandler packet_handlers[256] = {
+    [CMD_HEALTH] = handle_health,
+    [CMD_BIND] = handle_bind,
+    [CMD_HEARTBEAT] = handle_heartbeat,
+    [CMD_SUPPRESS_DELTA] = handle_suppress_delta,
+    [CMD_SUPPRESS_FILTER] = handle_suppress_filter,
+};
+
 /*********************************************************************
  * @fn      parse_packet
  *
@@ -52,6 +498,7 @@
  *                   Bind ZigBee connction with Gateway.
  *
  * @param   packet - the packet of ZigBee
+ *          len - length of the packet
  *          address - Gateway's ZigBee mac address.
  *                    When Lbeacon get 'b' request
  *                    it can use "@fn bind_gateway"
@@ -59,23 +506,40 @@
  *
  * @return  none
  */
-void parse_packet(unsigned char* packet, struct xbee_conAddress address) {
-  // struct Packet myPacket;
-  unsigned char myPacket[81];
-  switch (packet[0]) {
-    case 's':
+void parse_packet(unsigned char* packet,
+                  int len,
+                  struct xbee_conAddress address) {
+  packet_receive(packet_handlers, packet, len, &address);
+}
 
-      break;
-    case 'r':
-      myPacket[0] = 'v';
-      xbee_conTx(g_con, NULL, myPacket);
-      break;
-    case 'b':
-      bind_gateway(address);
-      break;
-  };
-  return;
+/*********************************************************************
+ * @fn      zigbee_report
+ *
+ * @brief   Print the statistics of the ZigBee codec
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void zigbee_report() {
+  pthread_mutex_lock(&packet_lock);
+  printf("ZigBee report\n");
+  printf("  received: %lld frames, %lld messages, %lld fragments, %lld legacy\n",
+         packet_stats.frames, packet_stats.messages, packet_stats.fragments,
+         packet_stats.legacy);
+  printf("  dropped:  %lld bad length, %lld bad version, %lld bad CRC, "
+         "%lld duplicates, %lld timed out, %lld unknown\n",
+         packet_stats.bad_length, packet_stats.bad_version,
+         packet_stats.bad_crc, packet_stats.duplicates, packet_stats.timeouts,
+         packet_stats.unknown);
+  printf("  sent:     %lld messages, %lld frames, %lld errors\n",
+         __sync_add_and_fetch(&packet_stats.sent_messages, 0),
+         __sync_add_and_fetch(&packet_stats.sent_frames, 0),
+         __sync_add_and_fetch(&packet_stats.send_errors, 0));
+  pthread_mutex_unlock(&packet_lock);
+  fflush(NULL);
 }
+
 void error(char* msg) {
   perror(msg);
   exit(0);
@@ -152,6 +616,7 @@ int addr_status_check(char addr[]) {
       }
       UsedDeviceQueue.DeviceUsed[i] = 1;
       UsedDeviceQueue.DeviceAppearTime[i] = getSystemTime();
+      dedup_dirty = 1;
       return IfUsed;
     }
   }
@@ -194,469 +659,4967 @@ Threadaddr Taddr[30];
  *          has_rssi - has RSSI value or not
  *          rssi - RSSI value
  *
- * @return  none
+ * @return  0: no idle push slot
+ *          1: address is pushed or was pushed recently
  */
-static void sendToPushDongle(bdaddr_t* bdaddr, char has_rssi, int rssi) {
-  int i = 0, j = 0, idle = -1;
+static int sendToPushDongle(bdaddr_t* bdaddr, char has_rssi, int rssi) {
+  int i = 0, j = 0, idle = -1, slot, up, down_idle = 0;
   char addr[18];
 
   void* status;
   ba2str(bdaddr, addr);
-  for (i = 0; i < PUSHDONGLES; i++)
+  for (i = 0; i < PUSHDONGLES; i++) {
+    //  Slots of a Push dongle which is down take no job
+    up = adapter_ready(ADAPTER_PUSH, i) >= 0;
     for (j = 0; j < NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE; j++) {
-      if (compare_strings(addr, addrbufferlist[i * j + j]) == 0) {
+      slot = i * NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE + j;
+      if (compare_strings(addr, addrbufferlist[slot]) == 0) {
+        TRACE_INSTANT("dedup pushing", addr, slot);
         goto out;
       }
-      if (IdleHandler[i * j + j] != 1 && idle == -1) {
-        idle = i * j + j;
+      if (IdleHandler[slot] != 1 && idle == -1) {
+        if (up)
+          idle = slot;
+        else
+          down_idle = 1;
       }
     }
+  }
   if (idle != -1 && addr_status_check(addr) == 0) {
     Threadaddr* param = &Taddr[idle];
+    pthread_attr_t attr;
+    TRACE_INSTANT("assign slot", addr, idle);
     IdleHandler[idle] = 1;
+    //  Reap the previous thread of this slot so its stack can be reused
+    if (param->joinable) {
+      pthread_join(param->t, NULL);
+      param->joinable = 0;
+    }
     printf("%d\n", sizeof(addr) / sizeof(addr[0]));
     for (i = 0; i < sizeof(addr) / sizeof(addr[0]); i++) {
       addrbufferlist[idle][i] = addr[i];
       param->addr[i] = addr[i];
     }
     param->threadId = idle;
-    pthread_create(&Taddr[idle].t, NULL, send_file, &Taddr[idle]);
+    pthread_attr_init(&attr);
+    if (stack_arena.base != NULL)
+      pthread_attr_setstack(&attr, stack_arena.base + idle * push_stack_size,
+                            push_stack_size);
+    else if (push_stack_size > 0)
+      pthread_attr_setstacksize(&attr, push_stack_size);
+    if (pthread_create(&param->t, &attr, send_file, param) == 0) {
+      param->joinable = 1;
+      pushes_started++;
+    } else {
+      perror("Can't create push thread");
+      IdleHandler[idle] = 0;
+      memset(addrbufferlist[idle], 0, sizeof(addrbufferlist[idle]));
+      idle = -1;
+    }
+    pthread_attr_destroy(&attr);
+  } else if (idle == -1) {
+    push_slot_misses++;
+    if (down_idle)
+      __sync_add_and_fetch(&push_slots_down, 1);
+    TRACE_INSTANT("no idle slot", addr, 0);
+  } else {
+    TRACE_INSTANT("dedup recent", addr, idle);
   }
+  return idle != -1;
 out:
-  return;
+  return 1;
 }
 
 /*********************************************************************
- * @fn      scanner_start
+ * @fn      cod_rule_match
  *
- * @brief   Asynchronous scaning bluetooth device
+ * @brief   Check a major and minor class against a list of rules
  *
- * @param   none
+ * @param   rules - list of rules
+ *          count - number of rules
+ *          major - major device class
+ *          minor - minor device class
  *
- * @return  none
+ * @return  0: no rule matches
+ *          1: a rule matches
  */
-static void scanner_start() {
-  int dev_id, sock = 0;
-  struct hci_filter flt;
-  inquiry_cp cp;
-  unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-  hci_event_hdr* hdr;
-  char canceled = 0;
-  inquiry_info_with_rssi* info_rssi;
-  inquiry_info* info;
-  int results, i, len;
-  struct pollfd p;
+static int cod_rule_match(CodRule* rules, int count, int major, int minor) {
+  int i;
 
-  // dev_id = hci_get_route(NULL);
-  dev_id = SCAN_DONGLE;
-  printf("%d", dev_id);
+  for (i = 0; i < count; i++)
+    if (rules[i].major == major &&
+        (rules[i].minor == COD_ANY_MINOR || rules[i].minor == minor))
+      return 1;
+  return 0;
+}
 
-  // Open Bluetooth device
-  sock = hci_open_dev(dev_id);
-  if (dev_id < 0 || sock < 0) {
-    perror("Can't open socket");
-    return;
-  }
-  // Setup filter
-  hci_filter_clear(&flt);
-  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
-  hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
-  hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
-  hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
-  if (setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
-    perror("Can't set HCI filter");
-    return;
-  }
-  hci_write_inquiry_mode(sock, 0x01, 10);
-  if (hci_send_cmd(sock, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
-                   WRITE_INQUIRY_MODE_RP_SIZE, &cp) < 0) {
-    perror("Can't set inquiry mode");
-    return;
-  }
+/*********************************************************************
+ * @fn      cod_filter_accept
+ *
+ * @brief   Check the Class of Device of a scanned device before it is
+ *          merged and sent to the push dongles, so headsets, car kits,
+ *          laptops and watches don't take push slots. A rejected
+ *          device is kept in a short-lived cache.
+ *
+ * @param   bdaddr - Bluetooth address
+ *          dev_class - Class of Device of the inquiry result
+ *          rssi - RSSI value
+ *
+ * @return  0: device rejected
+ *          1: device accepted
+ */
+int cod_filter_accept(bdaddr_t* bdaddr, uint8_t dev_class[3], int rssi) {
+  long long now;
+  int major = dev_class[1] & 0x1F;
+  int minor = (dev_class[0] >> 2) & 0x3F;
+  int i, slot = 0;
 
-  memset(&cp, 0, sizeof(cp));
-  cp.lap[2] = 0x9e;
-  cp.lap[1] = 0x8b;
-  cp.lap[0] = 0x33;
-  cp.num_rsp = 0;
-  cp.length = 0x30;
+  if (cod_allow_count == 0 && cod_deny_count == 0)
+    return 1;
 
-  printf("Starting inquiry with RSSI...\n");
+  now = getSystemTime();
+  pthread_mutex_lock(&cod_lock);
+  for (i = 0; i < COD_CACHE_SIZE; i++) {
+    if (cod_cache[i].expire > now && bacmp(&cod_cache[i].bdaddr, bdaddr) == 0) {
+      cod_cache_hits++;
+      pthread_mutex_unlock(&cod_lock);
+      return 0;
+    }
+    if (cod_cache[i].expire < cod_cache[slot].expire)
+      slot = i;
+  }
 
-  if (hci_send_cmd(sock, OGF_LINK_CTL, OCF_INQUIRY, INQUIRY_CP_SIZE, &cp) < 0) {
-    perror("Can't start inquiry");
-    return;
+  if (!cod_rule_match(cod_deny, cod_deny_count, major, minor) &&
+      (cod_allow_count == 0 ||
+       cod_rule_match(cod_allow, cod_allow_count, major, minor))) {
+    cod_accepted++;
+    pthread_mutex_unlock(&cod_lock);
+    return 1;
   }
 
-  p.fd = sock;
-  p.events = POLLIN | POLLERR | POLLHUP;
+  //  The entry closest to expiry makes room for the rejected device
+  bacpy(&cod_cache[slot].bdaddr, bdaddr);
+  cod_cache[slot].expire = now + cod_reject_timeout;
+  cod_rejected[major]++;
+  if (rssi > RSSI_RANGE)
+    cod_rejected_in_range++;
+  pthread_mutex_unlock(&cod_lock);
+  return 0;
+}
 
-  while (!canceled) {
-    p.revents = 0;
+/*********************************************************************
+ * @fn      cod_parse_rules
+ *
+ * @brief   Read a comma separated list of "major[:minor]" rules, e.g.
+ *          "4,1:3". Values are decimal or hex with "0x".
+ *
+ * @param   list - value of the config line
+ *          rules - list of rules to fill
+ *
+ * @return  Number of rules
+ */
+static int cod_parse_rules(char* list, CodRule* rules) {
+  char buffer[MAXBUF];
+  char *token, *minor, *saveptr = NULL;
+  int count = 0;
 
-    // Poll the Bluetooth device for an event
-    if (poll(&p, 1, -1) > 0) {
-      len = read(sock, buf, sizeof(buf));
+  memcpy(buffer, list, sizeof(buffer));
+  for (token = strtok_r(buffer, ", \r\n", &saveptr);
+       token != NULL && count < MAX_COD_RULES;
+       token = strtok_r(NULL, ", \r\n", &saveptr)) {
+    minor = strchr(token, ':');
+    rules[count].major = (int)strtol(token, NULL, 0) & 0x1F;
+    rules[count].minor =
+        minor != NULL ? (int)strtol(minor + 1, NULL, 0) & 0x3F : COD_ANY_MINOR;
+    count++;
+  }
+  return count;
+}
 
-      if (len < 0)
-        continue;
-      else if (len == 0)
-        break;
+/*********************************************************************
+ * @fn      cod_filter_init
+ *
+ * @brief   Read the allow and deny rules of the Class of Device filter
+ *          from config. The filter is off when both lists are empty.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  none
+ */
+void cod_filter_init(struct config* cfg) {
+  cod_allow_count = cod_parse_rules(cfg->cod_allow, cod_allow);
+  cod_deny_count = cod_parse_rules(cfg->cod_deny, cod_deny);
+  cod_reject_timeout =
+      get_config_int(cfg->cod_reject_timeout, cfg->cod_reject_timeout_len,
+                     DEFAULT_COD_REJECT_TIMEOUT);
+}
 
-      hdr = (void*)(buf + 1);
-      ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+/*********************************************************************
+ * @fn      cod_report
+ *
+ * @brief   Print the rejections of each major class and the push slot
+ *          time they saved, estimated with the mean time a push holds
+ *          its slot.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void cod_report() {
+  static const char* majors[] = {"misc",    "computer",   "phone",
+                                 "network", "audio",      "peripheral",
+                                 "imaging", "wearable",   "toy",
+                                 "health"};
+  long long rejected = 0, mean_push;
+  int i;
 
-      results = ptr[0];
+  pthread_mutex_lock(&cod_lock);
+  for (i = 0; i < COD_MAJOR_CLASSES; i++)
+    rejected += cod_rejected[i];
+  mean_push = push_slot_uses ? push_slot_time / push_slot_uses : 0;
+  printf("Class of Device filter (%d allow, %d deny rules)\n", cod_allow_count,
+         cod_deny_count);
+  printf("  %lld results accepted, %lld devices rejected, %lld cached\n",
+         cod_accepted, rejected, cod_cache_hits);
+  for (i = 0; i < COD_MAJOR_CLASSES; i++)
+    if (cod_rejected[i] > 0)
+      printf("  major 0x%02X %-10s %lld rejected\n", i,
+             i < (int)(sizeof(majors) / sizeof(majors[0])) ? majors[i] : "",
+             cod_rejected[i]);
+  printf("  %lld rejected in range, ~%lld s of push slot time saved\n",
+         cod_rejected_in_range, cod_rejected_in_range * mean_push / 1000);
+  pthread_mutex_unlock(&cod_lock);
+  fflush(NULL);
+}
 
-      switch (hdr->evt) {
-        case EVT_INQUIRY_RESULT:
-          for (i = 0; i < results; i++) {
-            info = (void*)ptr + (sizeof(*info) * i) + 1;
-            print_result(&info->bdaddr, 0, 0);
-          }
-          break;
+/*********************************************************************
+ * @fn      scan_merge_result
+ *
+ * @brief   Merge a result of one Scan dongle into the deduplicated
+ *          stream of all Scan dongles. Each device is kept with the
+ *          best RSSI seen by any dongle, and is sent to the push
+ *          dongles once its best RSSI is in range.
+ *
+ * @param   adapter - Scan dongle which got the result
+ *          bdaddr - Bluetooth address
+ *          rssi - RSSI value
+ *
+ * @return  none
+ */
+void scan_merge_result(ScanAdapter* adapter, bdaddr_t* bdaddr, int rssi) {
+  long long now = getSystemTime();
+  ScannedDevice* device = NULL;
+  char addr[18];
+  int i, free_slot = -1, oldest = 0;
 
-        case EVT_INQUIRY_RESULT_WITH_RSSI:
-          for (i = 0; i < results; i++) {
-            info_rssi = (void*)ptr + (sizeof(*info_rssi) * i) + 1;
-            print_result(&info_rssi->bdaddr, 1, info_rssi->rssi);
-            if (info_rssi->rssi > RSSI_RANGE)
-              sendToPushDongle(&info_rssi->bdaddr, 1, info_rssi->rssi);
-          }
-          break;
+  pthread_mutex_lock(&scan_lock);
+  adapter->results++;
+  for (i = 0; i < MAX_SCANNED_DEVICE; i++) {
+    ScannedDevice* entry = &scanned_devices[i];
+    if (entry->used && now - entry->last_seen > scan_merge_window)
+      entry->used = 0;
+    if (!entry->used) {
+      if (free_slot == -1)
+        free_slot = i;
+      continue;
+    }
+    if (entry->last_seen < scanned_devices[oldest].last_seen)
+      oldest = i;
+    if (device == NULL && bacmp(&entry->bdaddr, bdaddr) == 0)
+      device = entry;
+  }
 
-        case EVT_INQUIRY_COMPLETE:
-          canceled = 1;
+  if (device == NULL) {
+    //  A full table drops the device seen longest ago
+    device = &scanned_devices[free_slot != -1 ? free_slot : oldest];
+    memset(device, 0, sizeof(*device));
+    bacpy(&device->bdaddr, bdaddr);
+    device->used = 1;
+    device->best_rssi = rssi;
+    device->adapter = adapter->index;
+    device->first_seen = now;
+    adapter->new_devices++;
+    scan_merged_unique++;
+    print_result(bdaddr, 1, rssi);
+  } else {
+    adapter->returning++;
+    if (rssi > device->best_rssi) {
+      device->best_rssi = rssi;
+      device->adapter = adapter->index;
+      adapter->best_rssi_updates++;
+      print_result(bdaddr, 1, rssi);
+    }
+  }
+  device->last_seen = now;
 
-          break;
-      }
+  //  A device suppressed for a neighbour's push is checked again once
+  //  that push may have left the neighbour index
+  if (device->suppressed > 0 && now - device->suppressed >= suppress_time) {
+    device->suppressed = 0;
+    device->dispatched = 0;
+  }
+  //  Pushed by a neighbour LBeacon a short while ago, counted once
+  if (!device->dispatched && device->best_rssi > RSSI_RANGE) {
+    ba2str(bdaddr, addr);
+    if (suppress_check(addr)) {
+      device->suppressed = now;
+      device->dispatched = 1;
+      TRACE_INSTANT("suppressed", addr, 0);
     }
   }
-  printf("Scaning done\n");
-  close(sock);
+  if (!device->dispatched && device->best_rssi > RSSI_RANGE) {
+    if (device->trace_gated == 0 && trace_enabled) {
+      device->trace_gated = trace_now();
+      TRACE_INSTANT_BDADDR("rssi gate", bdaddr, device->best_rssi);
+    }
+    device->dispatched = sendToPushDongle(bdaddr, 1, device->best_rssi);
+    //  Time from the RSSI gate until a push slot took the device
+    if (device->dispatched)
+      TRACE_SPAN_BDADDR("queued", bdaddr, device->trace_gated, 0);
+  }
+  pthread_mutex_unlock(&scan_lock);
 }
 
 /*********************************************************************
- * @fn      send_file
+ * @fn      scanner_process_event
  *
- * @brief   Thread of Object push profile
+ * @brief   Parse an HCI event read from a Scan dongle and pass the
+ *          inquiry results to the merged result stream.
  *
- * @param   ptr: Scanned bluetooth address
+ * @param   adapter - Scan dongle which got the event
+ *          buf - HCI event packet
+ *          len - length of the packet
  *
- * @return  none
+ * @return  0: inquiry goes on
+ *          1: inquiry completed
  */
-void* send_file(void* ptr) {
-  int i = 0;
-  Threadaddr* Pigs = (Threadaddr*)ptr;
-  struct timeval start, end;
-  char* address = NULL;
-  int dev_id, sock;
-  int channel = -1;
-  // char *filepath = "/home/pi/smsb1.txt";
-  char* filename;
-  obexftp_client_t* cli = NULL; /*!!!*/
+int scanner_process_event(ScanAdapter* adapter, unsigned char* buf, int len) {
+  unsigned char* ptr;
+  hci_event_hdr* hdr;
+  inquiry_info_with_rssi* info_rssi;
+  inquiry_info* info;
+  int results, i;
+
+  if (len < 1 + HCI_EVENT_HDR_SIZE + 1)
+    return 0;
+  hdr = (void*)(buf + 1);
+  ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+
+  results = ptr[0];
+
+  switch (hdr->evt) {
+    case EVT_INQUIRY_RESULT:
+      if (results > (len - (ptr + 1 - buf)) / (int)sizeof(*info))
+        return 0;
+      for (i = 0; i < results; i++) {
+        info = (void*)ptr + (sizeof(*info) * i) + 1;
+        if (analytics_window > 0)
+          analytics_observe(analytics_hash(&info->bdaddr), getSystemTime());
+        print_result(&info->bdaddr, 0, 0);
+      }
+      break;
+
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+      if (results > (len - (ptr + 1 - buf)) / (int)sizeof(*info_rssi))
+        return 0;
+      for (i = 0; i < results; i++) {
+        info_rssi = (void*)ptr + (sizeof(*info_rssi) * i) + 1;
+        TRACE_INSTANT_BDADDR("inquiry result", &info_rssi->bdaddr,
+                             info_rssi->rssi);
+        //  Every device counts as presence, even those never pushed
+        if (analytics_window > 0)
+          analytics_observe(analytics_hash(&info_rssi->bdaddr),
+                            getSystemTime());
+        if (!cod_filter_accept(&info_rssi->bdaddr, info_rssi->dev_class,
+                               info_rssi->rssi))
+          continue;
+        scan_merge_result(adapter, &info_rssi->bdaddr, info_rssi->rssi);
+      }
+      break;
+
+    case EVT_INQUIRY_COMPLETE:
+      return 1;
+  }
+  return 0;
+}
+
+//  Set once every adapter was found at startup, an adapter coming up
+//  after that has its role restarted
+static int adapters_watching = 0;
+
+static AdapterRole* adapter_find(int role, int index) {
+  int i;
+
+  for (i = 0; i < adapter_role_count; i++)
+    if (adapter_roles[i].role == role && adapter_roles[i].index == index)
+      return &adapter_roles[i];
+  return NULL;
+}
+
+//  Add the adapter of a role from config, an address or a device ID,
+//  and return its device ID, -1 until an adapter of the address is found
+static int adapter_role_add(int role,
+                            int index,
+                            const char* token,
+                            int dev_id) {
+  AdapterRole* adapter;
+
+  if (adapter_role_count >= MAX_ADAPTER_ROLES)
+    return dev_id;
+  adapter = &adapter_roles[adapter_role_count++];
+  memset(adapter, 0, sizeof(*adapter));
+  adapter->role = role;
+  adapter->index = index;
+  adapter->dev_id = dev_id;
+  if (token != NULL && strlen(token) == 17 &&
+      str2ba(token, &adapter->bdaddr) == 0) {
+    adapter->by_address = 1;
+    adapter->dev_id = -1;
+  } else if (token != NULL) {
+    adapter->dev_id = atoi(token);
+  }
+  return adapter->dev_id;
+}
+
+/*********************************************************************
+ * Adapter backend of the HCI stack: device events of the stack on a
+ * raw HCI socket, and the device list and ioctls of the HCI layer
+ */
+static int hci_monitor_open() {
+  struct sockaddr_hci addr;
+  struct hci_filter flt;
+  int sock = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+
+  if (sock < 0)
+    return -1;
+  hci_filter_clear(&flt);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+  hci_filter_set_event(EVT_STACK_INTERNAL, &flt);
+  memset(&addr, 0, sizeof(addr));
+  addr.hci_family = AF_BLUETOOTH;
+  addr.hci_dev = HCI_DEV_NONE;
+  if (setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0 ||
+      bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static int hci_monitor_read(int fd, int* event, int* dev_id) {
+  unsigned char buf[HCI_MAX_EVENT_SIZE];
+  hci_event_hdr* hdr = (hci_event_hdr*)(buf + 1);
+  evt_stack_internal* si =
+      (evt_stack_internal*)(buf + 1 + HCI_EVENT_HDR_SIZE);
+  evt_si_device* sd = (evt_si_device*)si->data;
+  int len = read(fd, buf, sizeof(buf));
+
+  if (len < 0)
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  if (len < 1 + HCI_EVENT_HDR_SIZE + (int)sizeof(*si) + (int)sizeof(*sd) ||
+      hdr->evt != EVT_STACK_INTERNAL || btohs(si->type) != EVT_SI_DEVICE)
+    return 0;
+  *event = btohs(sd->event);
+  *dev_id = btohs(sd->dev_id);
+  return 1;
+}
+
+static int hci_monitor_info(int dev_id, bdaddr_t* bdaddr, int* up) {
+  struct hci_dev_info info;
+
+  if (hci_devinfo(dev_id, &info) < 0)
+    return -1;
+  bacpy(bdaddr, &info.bdaddr);
+  *up = hci_test_bit(HCI_UP, &info.flags) != 0;
+  return 0;
+}
+
+static int hci_monitor_up(int dev_id) {
+  int ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
   int ret;
-  pthread_t tid = pthread_self();
-  if (Pigs->threadId >= BLOCKOFDONGLE) {
-    dev_id = PUSH_DONGLE_B;
+
+  if (ctl < 0)
+    return -1;
+  ret = ioctl(ctl, HCIDEVUP, dev_id);
+  close(ctl);
+  return ret < 0 && errno != EALREADY ? -1 : 0;
+}
+
+AdapterBackend hci_adapter_backend = {"hci", hci_monitor_open,
+                                      hci_monitor_read, hci_monitor_info,
+                                      hci_monitor_up};
+
+/*********************************************************************
+ * Stand-in adapter backend of the load test: the adapters of every
+ * role are present and up until "@fn sim_adapter_event" takes them
+ * away or brings them back
+ */
+static int sim_adapter_open() {
+  AdapterRole* adapter;
+  int i, dev_id;
+
+  if (pipe(sim_adapter_pipe) < 0)
+    return -1;
+  pthread_mutex_lock(&adapter_lock);
+  for (i = 0; i < adapter_role_count; i++) {
+    adapter = &adapter_roles[i];
+    if (adapter->by_address || adapter->dev_id < 0 ||
+        adapter->dev_id >= HCI_MAX_DEV)
+      continue;
+    sim_adapters[adapter->dev_id].used = 1;
+    sim_adapters[adapter->dev_id].up = 1;
+    sim_adapters[adapter->dev_id].bdaddr.b[0] = adapter->dev_id;
+    sim_adapters[adapter->dev_id].bdaddr.b[5] = 0xAD;
+  }
+  for (i = 0; i < adapter_role_count; i++) {
+    adapter = &adapter_roles[i];
+    if (!adapter->by_address)
+      continue;
+    for (dev_id = 0; dev_id < HCI_MAX_DEV && sim_adapters[dev_id].used;
+         dev_id++)
+      ;
+    if (dev_id == HCI_MAX_DEV)
+      break;
+    sim_adapters[dev_id].used = 1;
+    sim_adapters[dev_id].up = 1;
+    bacpy(&sim_adapters[dev_id].bdaddr, &adapter->bdaddr);
+  }
+  pthread_mutex_unlock(&adapter_lock);
+  return sim_adapter_pipe[0];
+}
+
+static int sim_adapter_read(int fd, int* event, int* dev_id) {
+  int message[2];
+
+  if (read(fd, message, sizeof(message)) != sizeof(message))
+    return -1;
+  *event = message[0];
+  *dev_id = message[1];
+  return 1;
+}
+
+static int sim_adapter_info(int dev_id, bdaddr_t* bdaddr, int* up) {
+  int ret = -1;
+
+  pthread_mutex_lock(&adapter_lock);
+  if (dev_id >= 0 && dev_id < HCI_MAX_DEV && sim_adapters[dev_id].used) {
+    bacpy(bdaddr, &sim_adapters[dev_id].bdaddr);
+    *up = sim_adapters[dev_id].up;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&adapter_lock);
+  return ret;
+}
+
+/*********************************************************************
+ * @fn      sim_adapter_event
+ *
+ * @brief   Change a stand-in adapter as the HCI stack would and send
+ *          the event to the adapter manager.
+ *
+ * @param   event: HCI_DEV_REG, HCI_DEV_UNREG, HCI_DEV_UP or HCI_DEV_DOWN
+ *          dev_id: Device ID of the stand-in adapter
+ *          bdaddr: Address of an adapter registered, NULL otherwise
+ *
+ * @return  none
+ */
+void sim_adapter_event(int event, int dev_id, bdaddr_t* bdaddr) {
+  int message[2] = {event, dev_id};
+
+  if (dev_id < 0 || dev_id >= HCI_MAX_DEV)
+    return;
+  pthread_mutex_lock(&adapter_lock);
+  switch (event) {
+    case HCI_DEV_REG:
+      sim_adapters[dev_id].used = 1;
+      sim_adapters[dev_id].up = 0;
+      bacpy(&sim_adapters[dev_id].bdaddr, bdaddr);
+      break;
+    case HCI_DEV_UNREG:
+      sim_adapters[dev_id].used = 0;
+      sim_adapters[dev_id].up = 0;
+      break;
+    case HCI_DEV_UP:
+      sim_adapters[dev_id].up = 1;
+      break;
+    case HCI_DEV_DOWN:
+      sim_adapters[dev_id].up = 0;
+      break;
+  }
+  pthread_mutex_unlock(&adapter_lock);
+  if (write(sim_adapter_pipe[1], message, sizeof(message)) < 0)
+    perror("Can't send stand-in adapter event");
+}
+
+static int sim_adapter_up(int dev_id) {
+  sim_adapter_event(HCI_DEV_UP, dev_id, NULL);
+  return 0;
+}
+
+//  Check that a stand-in adapter is still up
+static int sim_adapter_alive(int dev_id) {
+  int up;
+
+  pthread_mutex_lock(&adapter_lock);
+  up = dev_id >= 0 && dev_id < HCI_MAX_DEV && sim_adapters[dev_id].used &&
+       sim_adapters[dev_id].up;
+  pthread_mutex_unlock(&adapter_lock);
+  return up;
+}
+
+AdapterBackend sim_adapter_backend = {"stand-in", sim_adapter_open,
+                                      sim_adapter_read, sim_adapter_info,
+                                      sim_adapter_up};
+
+AdapterBackend* adapter_backend = &hci_adapter_backend;
+
+//  Advertise the coordinates over BLE on an adapter
+static int adapter_advertise(int dev_id) {
+  char cmd[sizeof(BLE_coordinate_cmd) + 16];
+  const char* hci_cmd = strstr(BLE_coordinate_cmd, " cmd ");
+  int ret = 0;
+
+  if (dev_id < 0 || hci_cmd == NULL)
+    return -1;
+  snprintf(cmd, sizeof(cmd), "hciconfig hci%d leadv 3", dev_id);
+  if (system(cmd) != 0)
+    ret = -1;
+  snprintf(cmd, sizeof(cmd), "hciconfig hci%d noscan", dev_id);
+  if (system(cmd) != 0)
+    ret = -1;
+  snprintf(cmd, sizeof(cmd), "hcitool -i hci%d%s", dev_id, hci_cmd);
+  if (system(cmd) != 0)
+    ret = -1;
+  return ret;
+}
+
+/*********************************************************************
+ * @fn      adapter_event
+ *
+ * @brief   Follow an adapter registered, unregistered, up or down.
+ *          An adapter known by its address is bound to the device ID
+ *          it registers with, and brought up unless the stack did. An
+ *          adapter coming up restarts its role: scanners waiting in
+ *          "@fn adapter_wait" resume, push slots of its Push dongle
+ *          take jobs again, and advertising is set up again. An
+ *          adapter going down takes its role down with it.
+ *
+ * @param   event: HCI_DEV_REG, HCI_DEV_UNREG, HCI_DEV_UP or HCI_DEV_DOWN
+ *          dev_id: Device ID of the adapter
+ *
+ * @return  none
+ */
+void adapter_event(int event, int dev_id) {
+  AdapterRole* adapter;
+  AdapterRole* advertiser = NULL;
+  long long now = getSystemTime();
+  bdaddr_t bdaddr;
+  int up = 0, known, bring_up = 0, woken = 0, i;
+
+  known = adapter_backend->info(dev_id, &bdaddr, &up) == 0;
+  pthread_mutex_lock(&adapter_lock);
+  adapter_events++;
+  if (event == HCI_DEV_REG && known) {
+    for (i = 0; i < adapter_role_count; i++) {
+      adapter = &adapter_roles[i];
+      if (!adapter->by_address || bacmp(&adapter->bdaddr, &bdaddr) != 0)
+        continue;
+      adapter->dev_id = dev_id;
+    }
+    //  Registered up already, e.g. found at startup
+    if (up)
+      event = HCI_DEV_UP;
+  }
+  for (i = 0; i < adapter_role_count; i++) {
+    adapter = &adapter_roles[i];
+    if (adapter->dev_id != dev_id)
+      continue;
+    switch (event) {
+      case HCI_DEV_REG:
+        //  Only an adapter which is there, a role whose device ID is
+        //  missing is brought up when it registers
+        bring_up = known;
+        break;
+      case HCI_DEV_UP:
+        if (adapter->up)
+          break;
+        adapter->up = 1;
+        adapter->changed = now;
+        if (adapter->downs > 0)
+          adapter->recoveries++;
+        if (adapter->role == ADAPTER_ADVERTISE && adapters_watching)
+          advertiser = adapter;
+        else if (adapter->role == ADAPTER_PUSH)
+          adapter->recovery_ms = 0;
+        woken = 1;
+        break;
+      case HCI_DEV_DOWN:
+      case HCI_DEV_UNREG:
+        if (adapter->up) {
+          adapter->up = 0;
+          adapter->changed = now;
+          adapter->downs++;
+          printf("Adapter hci%d of %s %d is down\n", dev_id,
+                 adapter->role == ADAPTER_SCAN   ? "scan"
+                 : adapter->role == ADAPTER_PUSH ? "push"
+                                                 : "advertise",
+                 adapter->index);
+        }
+        if (event == HCI_DEV_UNREG && adapter->by_address)
+          adapter->dev_id = -1;
+        break;
+    }
+  }
+  if (woken)
+    pthread_cond_broadcast(&adapter_cond);
+  pthread_mutex_unlock(&adapter_lock);
+
+  if (bring_up && adapter_backend->up(dev_id) < 0)
+    fprintf(stderr, "Can't bring up hci%d\n", dev_id);
+  if (advertiser != NULL) {
+    adapter_advertise(dev_id);
+    pthread_mutex_lock(&adapter_lock);
+    advertiser->recovery_ms = getSystemTime() - now;
+    pthread_mutex_unlock(&adapter_lock);
+  }
+}
+
+//  Thread of the adapter manager, handling the events of the backend
+static void* adapter_monitor(void* ptr) {
+  int fd = (int)(intptr_t)ptr;
+  int event, dev_id, ret;
+
+  trace_thread_name("adapter manager");
+  while ((ret = adapter_backend->read(fd, &event, &dev_id)) >= 0)
+    if (ret > 0)
+      adapter_event(event, dev_id);
+  perror("Adapter events stopped");
+  return NULL;
+}
+
+/*********************************************************************
+ * @fn      adapters_init
+ *
+ * @brief   Read the Push dongles and the advertising adapter from
+ *          config, each a device ID or the address of the adapter,
+ *          find the adapters present and start the adapter manager
+ *          thread following them. When adapter events can't be read,
+ *          the adapters of a device ID are taken as up, as before.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  none
+ */
+void adapters_init(struct config* cfg) {
+  int defaults[PUSHDONGLES] = {PUSH_DONGLE_A, PUSH_DONGLE_B};
+  char list[MAXBUF];
+  char* token;
+  char* saveptr = NULL;
+  pthread_t monitor;
+  int fd, i, dev_id, count = 0;
+
+  memcpy(list, cfg->push_dongles, sizeof(list));
+  for (token = strtok_r(list, ", \r\n", &saveptr);
+       token != NULL && count < PUSHDONGLES;
+       token = strtok_r(NULL, ", \r\n", &saveptr))
+    if (isxdigit((unsigned char)*token))
+      adapter_role_add(ADAPTER_PUSH, count++, token, -1);
+  for (; count < PUSHDONGLES; count++)
+    adapter_role_add(ADAPTER_PUSH, count, NULL, defaults[count]);
+  memcpy(list, cfg->advertise_dongle, sizeof(list));
+  token = strtok_r(list, ", \r\n", &saveptr);
+  adapter_role_add(ADAPTER_ADVERTISE, 0,
+                   token != NULL && isxdigit((unsigned char)*token) ? token
+                                                                    : NULL,
+                   ADVERTISE_DONGLE);
+
+  //  Events are read from before the adapters are listed, so none is
+  //  missed in between
+  fd = adapter_backend->open();
+  for (dev_id = 0; dev_id < HCI_MAX_DEV; dev_id++)
+    adapter_event(HCI_DEV_REG, dev_id);
+  if (fd < 0) {
+    fprintf(stderr, "Adapter events can't be read, no hot-plug\n");
+    pthread_mutex_lock(&adapter_lock);
+    for (i = 0; i < adapter_role_count; i++)
+      if (adapter_roles[i].dev_id >= 0)
+        adapter_roles[i].up = 1;
+    pthread_mutex_unlock(&adapter_lock);
+  } else if (pthread_create(&monitor, NULL, adapter_monitor,
+                            (void*)(intptr_t)fd) == 0) {
+    pthread_detach(monitor);
+  }
+  pthread_mutex_lock(&adapter_lock);
+  adapters_watching = 1;
+  pthread_mutex_unlock(&adapter_lock);
+}
+
+int adapter_ready(int role, int index) {
+  AdapterRole* adapter;
+  int dev_id = -1;
+
+  pthread_mutex_lock(&adapter_lock);
+  adapter = adapter_find(role, index);
+  if (adapter != NULL && adapter->up)
+    dev_id = adapter->dev_id;
+  pthread_mutex_unlock(&adapter_lock);
+  return dev_id;
+}
+
+int adapter_dev_id(int role, int index) {
+  AdapterRole* adapter;
+  int dev_id = -1;
+
+  pthread_mutex_lock(&adapter_lock);
+  adapter = adapter_find(role, index);
+  if (adapter != NULL)
+    dev_id = adapter->dev_id;
+  pthread_mutex_unlock(&adapter_lock);
+  return dev_id;
+}
+
+//  Times the adapter of a role went down, to tell whether it went down
+//  during a push
+static long long adapter_downs(int role, int index) {
+  AdapterRole* adapter;
+  long long downs = 0;
+
+  pthread_mutex_lock(&adapter_lock);
+  adapter = adapter_find(role, index);
+  if (adapter != NULL)
+    downs = adapter->downs;
+  pthread_mutex_unlock(&adapter_lock);
+  return downs;
+}
+
+//  Wait for the adapter of a role to be up, and return its device ID
+static int adapter_wait(int role, int index) {
+  AdapterRole* adapter;
+  int dev_id, waited = 0;
+
+  pthread_mutex_lock(&adapter_lock);
+  adapter = adapter_find(role, index);
+  while (adapter != NULL && !adapter->up) {
+    waited = 1;
+    pthread_cond_wait(&adapter_cond, &adapter_lock);
+  }
+  if (adapter != NULL && waited)
+    adapter->recovery_ms = getSystemTime() - adapter->changed;
+  dev_id = adapter != NULL ? adapter->dev_id : -1;
+  pthread_mutex_unlock(&adapter_lock);
+  return dev_id;
+}
+
+//  Pause after a failure, cut short when an adapter comes up
+static void adapter_pause(int ms) {
+  long long until = getSystemTime() + ms;
+  struct timespec deadline;
+
+  //  getSystemTime is the realtime clock used by the condition
+  deadline.tv_sec = until / 1000;
+  deadline.tv_nsec = until % 1000 * 1000000;
+  pthread_mutex_lock(&adapter_lock);
+  pthread_cond_timedwait(&adapter_cond, &adapter_lock, &deadline);
+  pthread_mutex_unlock(&adapter_lock);
+}
+
+//  Let the merged entry of a device be dispatched again, called with
+//  scan_lock held when the device leaves the pushed devices
+static void scan_redispatch(const char* addr) {
+  bdaddr_t bdaddr;
+  int i;
+
+  str2ba(addr, &bdaddr);
+  for (i = 0; i < MAX_SCANNED_DEVICE; i++)
+    if (scanned_devices[i].used &&
+        bacmp(&scanned_devices[i].bdaddr, &bdaddr) == 0)
+      scanned_devices[i].dispatched = 0;
+}
+
+/*********************************************************************
+ * @fn      dedup_forget
+ *
+ * @brief   Remove a device from the pushed devices, so it can be pushed
+ *          on its next inquiry result instead of after Timeout. Used
+ *          when a push failed because of its Push dongle rather than
+ *          the device.
+ *
+ * @param   addr: Bluetooth address of the device
+ *
+ * @return  none
+ */
+void dedup_forget(const char* addr) {
+  int i;
+
+  pthread_mutex_lock(&scan_lock);
+  for (i = 0; i < MAX_OF_DEVICE; i++) {
+    if (UsedDeviceQueue.DeviceUsed[i] == 1 &&
+        compare_strings((char*)addr, UsedDeviceQueue.DeviceAppearAddr[i]) ==
+            0) {
+      memset(UsedDeviceQueue.DeviceAppearAddr[i], 0, 18);
+      UsedDeviceQueue.DeviceAppearTime[i] = 0;
+      UsedDeviceQueue.DeviceUsed[i] = 0;
+      dedup_dirty = 1;
+    }
+  }
+  scan_redispatch(addr);
+  pthread_mutex_unlock(&scan_lock);
+}
+
+/*********************************************************************
+ * @fn      adapter_report
+ *
+ * @brief   Print the adapter of each role with its state, outages and
+ *          the time its role took to run again, and the pushes lost
+ *          to Push dongles going down.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void adapter_report() {
+  static const char* roles[] = {"scan", "push", "advertise"};
+  long long now = getSystemTime();
+  AdapterRole* adapter;
+  char addr[18];
+  int i;
+
+  pthread_mutex_lock(&adapter_lock);
+  printf("Adapters (%s backend, %lld events)\n", adapter_backend->name,
+         adapter_events);
+  for (i = 0; i < adapter_role_count; i++) {
+    adapter = &adapter_roles[i];
+    if (adapter->by_address)
+      ba2str(&adapter->bdaddr, addr);
+    else
+      strcpy(addr, "-");
+    printf("  %-9s %d  hci%-2d %17s  %-4s %6lld s, %lld down, %lld back, "
+           "last in %lld ms\n",
+           roles[adapter->role], adapter->index, adapter->dev_id, addr,
+           adapter->up ? "up" : "down",
+           adapter->changed ? (now - adapter->changed) / 1000 : 0,
+           adapter->downs, adapter->recoveries, adapter->recovery_ms);
+  }
+  printf("  %lld pushes failed by a Push dongle, %lld jobs found idle slots "
+         "only on a dongle down\n",
+         push_adapter_failures, push_slots_down);
+  pthread_mutex_unlock(&adapter_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      scanner_start
+ *
+ * @brief   Asynchronous scaning bluetooth device
+ *
+ * @param   adapter - Scan dongle to run the inquiry on
+ *          dev_id - Device ID of the Scan dongle
+ *
+ * @return  0: inquiry completed
+ *          -1: Scan dongle can't be used
+ */
+static int scanner_start(ScanAdapter* adapter, int dev_id) {
+  int sock = 0;
+  struct hci_filter flt;
+  inquiry_cp cp;
+  unsigned char buf[HCI_MAX_EVENT_SIZE];
+  char canceled = 0;
+  int len, failed = 0;
+  struct pollfd p;
+  long long started;
+
+  // dev_id = hci_get_route(NULL);
+  printf("%d", dev_id);
+
+  // Open Bluetooth device
+  sock = hci_open_dev(dev_id);
+  if (dev_id < 0 || sock < 0) {
+    perror("Can't open socket");
+    return -1;
+  }
+  // Setup filter
+  hci_filter_clear(&flt);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+  hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
+  hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
+  hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
+  if (setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+    perror("Can't set HCI filter");
+    close(sock);
+    return -1;
+  }
+  hci_write_inquiry_mode(sock, 0x01, 10);
+  if (hci_send_cmd(sock, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
+                   WRITE_INQUIRY_MODE_RP_SIZE, &cp) < 0) {
+    perror("Can't set inquiry mode");
+    close(sock);
+    return -1;
+  }
+
+  memset(&cp, 0, sizeof(cp));
+  cp.lap[2] = 0x9e;
+  cp.lap[1] = 0x8b;
+  cp.lap[0] = 0x33;
+  cp.num_rsp = adapter->schedule.num_rsp;
+  cp.length = adapter->schedule.length;
+
+  printf("Starting inquiry with RSSI...\n");
+  inquiry_schedule_start(adapter);
+  started = getSystemTime();
+
+  if (hci_send_cmd(sock, OGF_LINK_CTL, OCF_INQUIRY, INQUIRY_CP_SIZE, &cp) < 0) {
+    perror("Can't start inquiry");
+    close(sock);
+    return -1;
+  }
+  adapter->inquiries++;
+
+  p.fd = sock;
+  p.events = POLLIN | POLLERR | POLLHUP;
+
+  while (!canceled) {
+    p.revents = 0;
+
+    // Poll the Bluetooth device for an event
+    if (poll(&p, 1, -1) > 0) {
+      len = read(sock, buf, sizeof(buf));
+
+      //  The dongle went away, e.g. unplugged or reset
+      if (len < 0 && errno != EINTR && errno != EAGAIN) {
+        perror("Inquiry stopped");
+        failed = 1;
+        break;
+      }
+      if (len < 0)
+        continue;
+      else if (len == 0)
+        break;
+
+      canceled = scanner_process_event(adapter, buf, len);
+    }
+  }
+  printf("Scaning done\n");
+  close(sock);
+  if (failed)
+    return -1;
+  inquiry_schedule_update(adapter, getSystemTime() - started);
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      inquiry_schedule_start
+ *
+ * @brief   Note the counters of a Scan dongle when its inquiry starts,
+ *          so the next update sees what this inquiry found. The cycle
+ *          before, inquiry and gap, is credited to the decision which
+ *          chose its parameters.
+ *
+ * @param   adapter - Scan dongle starting an inquiry
+ *
+ * @return  none
+ */
+void inquiry_schedule_start(ScanAdapter* adapter) {
+  InquirySchedule* schedule = &adapter->schedule;
+  long long now = getSystemTime();
+  int decision = schedule->last_decision;
+
+  pthread_mutex_lock(&scan_lock);
+  if (schedule->cycle_start > 0) {
+    schedule->decision_new[decision] +=
+        adapter->new_devices - schedule->new_mark;
+    schedule->decision_pushes[decision] +=
+        pushes_started - schedule->push_mark;
+    schedule->decision_seconds[decision] +=
+        (now - schedule->cycle_start) / 1000.0;
+  }
+  schedule->cycle_start = now;
+  schedule->new_mark = adapter->new_devices;
+  schedule->returning_mark = adapter->returning;
+  schedule->push_mark = pushes_started;
+  schedule->miss_mark = push_slot_misses;
+  pthread_mutex_unlock(&scan_lock);
+}
+
+/*********************************************************************
+ * @fn      inquiry_schedule_update
+ *
+ * @brief   Choose the length, response limit and following gap of the
+ *          next inquiry from what the last one found. Busy push slots,
+ *          or devices which found no idle slot, make inquiry back off:
+ *          shorter, fewer responses and a growing gap, so the radios
+ *          page for OBEX connects. A spike of new devices lengthens
+ *          inquiry, and a stable crowd of returning devices shortens
+ *          it.
+ *
+ * @param   adapter - Scan dongle whose inquiry completed
+ *          duration - time the inquiry took (ms)
+ *
+ * @return  none
+ */
+void inquiry_schedule_update(ScanAdapter* adapter, long long duration) {
+  InquirySchedule* schedule = &adapter->schedule;
+  double seconds = duration > 100 ? duration / 1000.0 : 0.1;
+  long long found, returning, misses;
+  int i, busy = 0, decision;
+  double new_rate;
+
+  pthread_mutex_lock(&scan_lock);
+  found = adapter->new_devices - schedule->new_mark;
+  returning = adapter->returning - schedule->returning_mark;
+  misses = push_slot_misses - schedule->miss_mark;
+  for (i = 0; i < PUSH_SLOTS; i++)
+    if (IdleHandler[i] == 1)
+      busy++;
+  pthread_mutex_unlock(&scan_lock);
+
+  if (!adaptive_inquiry)
+    return;
+
+  new_rate = found / seconds;
+  if (misses > 0 || busy * 100 >= PUSH_SLOTS * INQUIRY_BACK_OFF_PRESSURE) {
+    decision = INQUIRY_BACK_OFF;
+    schedule->length /= 2;
+    schedule->gap = schedule->gap > 0 ? schedule->gap * 2 : 1000;
+    schedule->num_rsp = (PUSH_SLOTS - busy) * 2 > 4 ? (PUSH_SLOTS - busy) * 2
+                                                    : 4;
+  } else if (found > 0 && new_rate > schedule->new_rate * 1.5) {
+    decision = INQUIRY_LENGTHEN;
+    schedule->length *= 2;
+    schedule->gap = 0;
+    schedule->num_rsp = 0;
+  } else if (found * 10 <= found + returning) {
+    decision = INQUIRY_SHORTEN;
+    schedule->length = schedule->length * 3 / 4;
+    schedule->gap /= 2;
+    schedule->num_rsp = 0;
+  } else {
+    decision = INQUIRY_KEEP;
+    schedule->gap /= 2;
+    schedule->num_rsp = 0;
+  }
+  if (schedule->length < inquiry_min_length)
+    schedule->length = inquiry_min_length;
+  if (schedule->length > inquiry_max_length)
+    schedule->length = inquiry_max_length;
+  if (schedule->gap > inquiry_max_gap)
+    schedule->gap = inquiry_max_gap;
+  schedule->new_rate = schedule->new_rate * 0.7 + new_rate * 0.3;
+  schedule->last_decision = decision;
+  schedule->decisions[decision]++;
+  printf("Inquiry on hci%d: %lld new, %lld returning, %d busy, %lld missed "
+         "-> length %d, gap %d ms, num_rsp %d\n",
+         adapter_dev_id(ADAPTER_SCAN, adapter->index), found, returning,
+         busy, misses, schedule->length,
+         schedule->gap, schedule->num_rsp);
+}
+
+/*********************************************************************
+ * @fn      inquiry_report
+ *
+ * @brief   Print the inquiry parameters of each Scan dongle, how often
+ *          each decision was taken and the discovery and push rates
+ *          of the inquiries run under it.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void inquiry_report() {
+  static const char* names[INQUIRY_DECISIONS] = {"keep", "lengthen",
+                                                 "shorten", "back off"};
+  int i, j;
+
+  printf("Inquiry report (%s)\n", adaptive_inquiry ? "adaptive" : "fixed");
+  for (i = 0; i < scan_adapter_count; i++) {
+    InquirySchedule* schedule = &scan_adapters[i].schedule;
+    printf("  hci%d: length %d (%.1f s), gap %d ms, num_rsp %d\n",
+           adapter_dev_id(ADAPTER_SCAN, i), schedule->length,
+           schedule->length * 1.28,
+           schedule->gap, schedule->num_rsp);
+    for (j = 0; j < INQUIRY_DECISIONS; j++)
+      if (schedule->decision_seconds[j] > 0)
+        printf("    %-8s %5lld times, %.0f s, %.2f new/s, %.2f pushes/s\n",
+               names[j], schedule->decisions[j], schedule->decision_seconds[j],
+               schedule->decision_new[j] / schedule->decision_seconds[j],
+               schedule->decision_pushes[j] / schedule->decision_seconds[j]);
+  }
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      scanner_thread
+ *
+ * @brief   Reader thread of one Scan dongle. Waits for its inquiry
+ *          phase offset once, then repeats inquiry.
+ *
+ * @param   ptr: ScanAdapter of the Scan dongle
+ *
+ * @return  none
+ */
+void* scanner_thread(void* ptr) {
+  ScanAdapter* adapter = (ScanAdapter*)ptr;
+  char trace_name[18];
+  int dev_id;
+
+  snprintf(trace_name, sizeof(trace_name), "scan hci%d",
+           adapter_dev_id(ADAPTER_SCAN, adapter->index));
+  trace_thread_name(trace_name);
+  if (adapter->phase_offset > 0)
+    usleep(adapter->phase_offset * 1000);
+  adapter->start_time = getSystemTime();
+  while (1) {
+    //  A Scan dongle which is down resumes as soon as it is back
+    dev_id = adapter_wait(ADAPTER_SCAN, adapter->index);
+    if (scanner_start(adapter, dev_id) < 0) {
+      adapter->failures++;
+      adapter_pause(1000);
+    } else if (adapter->schedule.gap > 0) {
+      usleep(adapter->schedule.gap * 1000);
+    }
+  }
+}
+
+/*********************************************************************
+ * @fn      scan_adapters_init
+ *
+ * @brief   Read the comma separated list of Scan dongles from config.
+ *          Dongle i starts its first inquiry i * Inquiry_Phase_Offset
+ *          ms after dongle 0, so that the dongles don't page at the
+ *          same time.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  none
+ */
+void scan_adapters_init(struct config* cfg) {
+  char list[MAXBUF];
+  char* token;
+  char* saveptr = NULL;
+  int i;
+  int offset = get_config_int(cfg->inquiry_phase_offset,
+                              cfg->inquiry_phase_offset_len, 0);
+
+  scan_merge_window = get_config_int(
+      cfg->scan_merge_window, cfg->scan_merge_window_len, DEFAULT_MERGE_WINDOW);
+  adaptive_inquiry =
+      get_config_int(cfg->adaptive_inquiry, cfg->adaptive_inquiry_len, 0);
+  inquiry_min_length =
+      get_config_int(cfg->inquiry_min_length, cfg->inquiry_min_length_len,
+                     DEFAULT_INQUIRY_MIN_LENGTH);
+  inquiry_max_length = get_config_int(
+      cfg->inquiry_max_length, cfg->inquiry_max_length_len, INQUIRY_LENGTH);
+  //  HCI Inquiry takes a length of 1 to 0x30
+  if (inquiry_max_length < 1 || inquiry_max_length > INQUIRY_LENGTH)
+    inquiry_max_length = INQUIRY_LENGTH;
+  if (inquiry_min_length < 1)
+    inquiry_min_length = 1;
+  if (inquiry_min_length > inquiry_max_length)
+    inquiry_min_length = inquiry_max_length;
+  inquiry_max_gap = get_config_int(cfg->inquiry_max_gap,
+                                   cfg->inquiry_max_gap_len,
+                                   DEFAULT_INQUIRY_MAX_GAP);
+  scan_adapter_count = 0;
+  adapter_role_count = 0;
+  memcpy(list, cfg->scan_dongles, sizeof(list));
+  for (token = strtok_r(list, ", \r\n", &saveptr);
+       token != NULL && scan_adapter_count < MAX_SCAN_DONGLES;
+       token = strtok_r(NULL, ", \r\n", &saveptr)) {
+    //  A device ID or the address of the dongle
+    if (!isxdigit((unsigned char)*token))
+      continue;
+    adapter_role_add(ADAPTER_SCAN, scan_adapter_count, token, -1);
+    scan_adapter_count++;
+  }
+  if (scan_adapter_count == 0) {
+    adapter_role_add(ADAPTER_SCAN, 0, NULL, SCAN_DONGLE);
+    scan_adapter_count = 1;
+  }
+  for (i = 0; i < scan_adapter_count; i++) {
+    scan_adapters[i].index = i;
+    scan_adapters[i].phase_offset = i * offset;
+    //  The first inquiry is the longest, everyone is new at startup
+    scan_adapters[i].schedule.length =
+        adaptive_inquiry ? inquiry_max_length : INQUIRY_LENGTH;
+  }
+}
+
+/*********************************************************************
+ * @fn      scan_report
+ *
+ * @brief   Print statistics of each Scan dongle and of the merged
+ *          result stream.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void scan_report() {
+  long long now = getSystemTime();
+  int best[MAX_SCAN_DONGLES] = {0};
+  int i;
+
+  pthread_mutex_lock(&scan_lock);
+  for (i = 0; i < MAX_SCANNED_DEVICE; i++)
+    if (scanned_devices[i].used)
+      best[scanned_devices[i].adapter]++;
+  printf("Scan report (%d dongles, %lld unique devices)\n", scan_adapter_count,
+         scan_merged_unique);
+  for (i = 0; i < scan_adapter_count; i++) {
+    ScanAdapter* adapter = &scan_adapters[i];
+    double seconds = adapter->start_time > 0
+                         ? (now - adapter->start_time) / 1000.0
+                         : 0;
+    printf(
+        "  hci%d: %lld inquiries, %lld failed, %lld results, %lld new "
+        "(%.2f/s), %lld best RSSI, %d devices held\n",
+        adapter_dev_id(ADAPTER_SCAN, i), adapter->inquiries, adapter->failures,
+        adapter->results, adapter->new_devices,
+        seconds > 0 ? adapter->new_devices / seconds : 0,
+        adapter->best_rssi_updates, best[i]);
+  }
+  pthread_mutex_unlock(&scan_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      send_file
+ *
+ * @brief   Thread of Object push profile
+ *
+ * @param   ptr: Scanned bluetooth address
+ *
+ * @return  none
+ */
+void* send_file(void* ptr) {
+  int i = 0;
+  Threadaddr* Pigs = (Threadaddr*)ptr;
+  struct timeval start, end;
+  char* address = NULL;
+  int dev_id, sock, dongle;
+  int channel = -1;
+  long long downs;
+  PushObject* object;
+  void* cli = NULL; /*!!!*/
+  int ret = -1;
+  int sent = 0;
+  long long put_start, teardown_start;
+  pthread_t tid = pthread_self();
+  long long slot_start = getSystemTime();
+  long long trace_push = TRACE_NOW(), trace_step;
+  char trace_name[18];
+  address = (char*)Pigs->addr;
+  snprintf(trace_name, sizeof(trace_name), "push slot %d", Pigs->threadId);
+  trace_thread_name(trace_name);
+  dongle = Pigs->threadId / NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE;
+  downs = adapter_downs(ADAPTER_PUSH, dongle);
+  dev_id = adapter_ready(ADAPTER_PUSH, dongle);
+  sock = dev_id >= 0 ? push_transport->attach(dev_id) : -1;
+  if (dev_id < 0 || sock < 0) {
+    perror("opening socket");
+    goto release;
+  }
+  printf("Thread number %d\n", Pigs->threadId);
+  // pthread_exit(0);
+  gettimeofday(&start, NULL);
+  long long start1 = getSystemTime();
+  trace_step = TRACE_NOW();
+  channel = push_transport->browse(address); /*!!!*/
+  TRACE_SPAN("sdp browse", address, trace_step, channel);
+  /* Open connection */
+  trace_step = TRACE_NOW();
+  cli = push_transport->open(); /*!!!*/
+  TRACE_SPAN("open", address, trace_step, cli != NULL);
+  if (cli == NULL) {
+    fprintf(stderr, "Error opening obexftp client\n");
+    __sync_add_and_fetch(&push_sessions_failed, 1);
+    goto release;
+  }
+  /* Connect to device */
+  trace_step = TRACE_NOW();
+  ret = push_transport->connect(cli, address, channel); /*!!!*/
+  TRACE_SPAN("connect", address, trace_step, ret);
+  long long end1 = getSystemTime();
+
+  printf("time: %lld ms\n", end1 - start1);
+  if (ret < 0) {
+    fprintf(stderr, "Error connecting to obexftp device\n");
+    __sync_add_and_fetch(&push_sessions_failed, 1);
+    push_transport->close(cli);
+    cli = NULL;
+    goto release;
+  }
+
+  /* Push each object of the profile in this session, from memory when
+   * it was preloaded. A failed object doesn't stop the others. */
+  for (i = 0; i < push_object_count; i++) {
+    object = &push_objects[i];
+    printf("Sending file %s to %s\n", object->name, address);
+    put_start = getSystemTime();
+    trace_step = TRACE_NOW();
+    ret = push_transport->put(cli, object->path, object->data, object->size,
+                              object->name); /*!!!*/
+    TRACE_SPAN("put", address, trace_step, ret);
+    pthread_mutex_lock(&push_lock);
+    object->put_time += getSystemTime() - put_start;
+    if (ret < 0) {
+      object->failed++;
+    } else {
+      object->sent++;
+      push_objects_sent++;
+      sent++;
+    }
+    pthread_mutex_unlock(&push_lock);
+    if (ret < 0) {
+      fprintf(stderr, "Error putting file %s\n", object->name);
+    }
+  }
+  ret = sent > 0 ? 0 : -1;
+
+  /* Disconnect */
+  teardown_start = getSystemTime();
+  trace_step = TRACE_NOW();
+  if (push_transport->disconnect(cli) < 0) { /*!!!*/
+    fprintf(stderr, "Error disconnecting the client\n");
+  }
+  /* Close */
+  push_transport->close(cli); /*!!!*/
+  cli = NULL;
+  TRACE_SPAN("disconnect", address, trace_step, 0);
+  pthread_mutex_lock(&push_lock);
+  push_sessions++;
+  push_setup_time += end1 - start1;
+  push_teardown_time += getSystemTime() - teardown_start;
+  pthread_mutex_unlock(&push_lock);
+release:
+  trace_step = TRACE_NOW();
+  //  A push failed by its Push dongle rather than by the device doesn't
+  //  hold the device until Timeout
+  if (ret < 0 && (sock < 0 || adapter_downs(ADAPTER_PUSH, dongle) != downs ||
+                  adapter_ready(ADAPTER_PUSH, dongle) < 0)) {
+    __sync_add_and_fetch(&push_adapter_failures, 1);
+    dedup_forget(address);
+  }
+  //  Only a device which got the content is suppressed at the neighbours
+  if (ret == 0)
+    suppress_pushed(address);
+  if (push_transport->finished != NULL)
+    push_transport->finished(address, ret);
+  __sync_add_and_fetch(&push_slot_time, getSystemTime() - slot_start);
+  __sync_add_and_fetch(&push_slot_uses, 1);
+  IdleHandler[Pigs->threadId] = 0;
+  for (i = 0; i < 18; i++) {
+    addrbufferlist[Pigs->threadId][i] = 0;
+  }
+  if (sock >= 0)
+    push_transport->detach(sock);
+  TRACE_SPAN("slot release", address, trace_step, Pigs->threadId);
+  TRACE_SPAN("push", address, trace_push, ret);
+  pthread_exit(0);
+}
+
+/*********************************************************************
+ * Push transport of obexftp, used by "@fn send_file" on real dongles
+ */
+static int obex_attach(int dev_id) {
+  return hci_open_dev(dev_id);
+}
+
+static void obex_detach(int sock) {
+  close(sock);
+}
+
+static int obex_browse(const char* address) {
+  return obexftp_browse_bt_push(address);
+}
+
+static void* obex_open() {
+  return obexftp_open(OBEX_TRANS_BLUETOOTH, NULL, NULL, NULL);
+}
+
+static int obex_connect(void* cli, const char* address, int channel) {
+  return obexftp_connect_push(cli, address, channel);
+}
+
+static int obex_put(void* cli,
+                    const char* path,
+                    const unsigned char* data,
+                    int size,
+                    const char* name) {
+  if (data != NULL)
+    return obexftp_put_data(cli, data, size, name);
+  return obexftp_put_file(cli, path, name);
+}
+
+static int obex_disconnect(void* cli) {
+  return obexftp_disconnect(cli);
+}
+
+static void obex_close(void* cli) {
+  obexftp_close(cli);
+}
+
+PushTransport obex_transport = {"obexftp",   obex_attach, obex_detach,
+                                obex_browse, obex_open,   obex_connect,
+                                obex_put,    obex_disconnect, obex_close,
+                                NULL};
+
+PushTransport* push_transport = &obex_transport;
+
+/*********************************************************************
+ * @fn      timeout_cleaner
+ *
+ * @brief   Thread of Timeout cleaner.
+ *          When Bluetooth was pushed by push function
+ *          it address will store in used list then
+ *          wait for timeout to be remove from list.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void* timeout_cleaner(void) {
+  long long next_save = getSystemTime() + DEDUP_SAVE_INTERVAL;
+
+  while (1) {
+    int i = 0, j;
+
+    if (report_requested) {
+      report_requested = 0;
+      print_status_report();
+    }
+    if (trace_toggle_requested) {
+      trace_toggle_requested = 0;
+      if (trace_enabled)
+        trace_stop();
+      else
+        trace_start();
+    }
+
+    //  The scan threads add to the queue under scan_lock. A device
+    //  still in range is pushed again once it expires.
+    pthread_mutex_lock(&scan_lock);
+    for (i = 0; i < MAX_OF_DEVICE; i++)
+      if (getSystemTime() - UsedDeviceQueue.DeviceAppearTime[i] > Timeout &&
+          UsedDeviceQueue.DeviceUsed[i] == 1) {
+        printf("Cleanertime: %lld ms\n",
+               getSystemTime() - UsedDeviceQueue.DeviceAppearTime[i]);
+        scan_redispatch(UsedDeviceQueue.DeviceAppearAddr[i]);
+        for (j = 0; j < 18; j++) {
+          UsedDeviceQueue.DeviceAppearAddr[i][j] = 0;
+        }
+        UsedDeviceQueue.DeviceAppearTime[i] = 0;
+        UsedDeviceQueue.DeviceUsed[i] = 0;
+        dedup_dirty = 1;
+      }
+    pthread_mutex_unlock(&scan_lock);
+    analytics_tick(getSystemTime());
+    suppress_tick(getSystemTime());
+    if (dedup_dirty && getSystemTime() >= next_save) {
+      dedup_save();
+      next_save = getSystemTime() + DEDUP_SAVE_INTERVAL;
+    }
+    usleep(CLEANER_INTERVAL * 1000);
+  }
+}
+
+/*********************************************************************
+ * @fn      get_config
+ *
+ * @brief   Read the config file and initialize parameter
+ *
+ * @param   filename: Name of config file
+ *
+ * @return  configstruct include filepath coordinate etc.
+ */
+struct config get_config(char* filename) {
+  struct config configstruct;
+  FILE* file = fopen(filename, "r");
+
+  memset(&configstruct, 0, sizeof(configstruct));
+
+  if (file != NULL) {
+    char line[MAXBUF];
+    int i = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+      char* cfline;
+      cfline = strstr((char*)line, DELIM);
+      cfline = cfline + strlen(DELIM);
+
+      if (i == 0) {
+        memcpy(configstruct.filepath, cfline, strlen(cfline));
+        configstruct.filepath_len = strlen(cfline);
+        // printf("%s",configstruct.imgserver);
+      } else if (i == 1) {
+        memcpy(configstruct.filename, cfline, strlen(cfline));
+        configstruct.filename_len = strlen(cfline);
+        // printf("%s",configstruct.ccserver);
+      } else if (i == 2) {
+        memcpy(configstruct.coordinate_X, cfline, strlen(cfline));
+        configstruct.coordinate_X_len = strlen(cfline);
+        // printf("%s",configstruct.port);
+      } else if (i == 3) {
+        memcpy(configstruct.coordinate_Y, cfline, strlen(cfline));
+        configstruct.coordinate_Y_len = strlen(cfline);
+        // printf("%s",configstruct.imagename);
+      } else if (i == 4) {
+        memcpy(configstruct.level, cfline, strlen(cfline));
+        configstruct.level_len = strlen(cfline);
+        // printf("%s",configstruct.getcmd);
+      } else if (i == 5) {
+        memcpy(configstruct.RSSI_Coverage, cfline, strlen(cfline));
+        configstruct.RSSI_Coverage_len = strlen(cfline);
+        // printf("%s",configstruct.coordinate_X);
+      } else if (i == 6) {
+        memcpy(configstruct.memory_budget, cfline, strlen(cfline));
+        configstruct.memory_budget_len = strlen(cfline);
+      } else if (i == 7) {
+        memcpy(configstruct.push_stack_kb, cfline, strlen(cfline));
+        configstruct.push_stack_kb_len = strlen(cfline);
+      } else if (i == 8) {
+        memcpy(configstruct.content_arena_kb, cfline, strlen(cfline));
+        configstruct.content_arena_kb_len = strlen(cfline);
+      } else if (i == 9) {
+        memcpy(configstruct.malloc_arena_max, cfline, strlen(cfline));
+        configstruct.malloc_arena_max_len = strlen(cfline);
+      } else if (i == 10) {
+        memcpy(configstruct.scan_dongles, cfline, strlen(cfline));
+        configstruct.scan_dongles_len = strlen(cfline);
+      } else if (i == 11) {
+        memcpy(configstruct.inquiry_phase_offset, cfline, strlen(cfline));
+        configstruct.inquiry_phase_offset_len = strlen(cfline);
+      } else if (i == 12) {
+        memcpy(configstruct.scan_merge_window, cfline, strlen(cfline));
+        configstruct.scan_merge_window_len = strlen(cfline);
+      } else if (i == 13) {
+        memcpy(configstruct.cod_allow, cfline, strlen(cfline));
+        configstruct.cod_allow_len = strlen(cfline);
+      } else if (i == 14) {
+        memcpy(configstruct.cod_deny, cfline, strlen(cfline));
+        configstruct.cod_deny_len = strlen(cfline);
+      } else if (i == 15) {
+        memcpy(configstruct.cod_reject_timeout, cfline, strlen(cfline));
+        configstruct.cod_reject_timeout_len = strlen(cfline);
+      } else if (i == 16) {
+        memcpy(configstruct.zigbee_legacy, cfline, strlen(cfline));
+        configstruct.zigbee_legacy_len = strlen(cfline);
+      } else if (i == 17) {
+        memcpy(configstruct.gateway_list, cfline, strlen(cfline));
+        configstruct.gateway_list_len = strlen(cfline);
+      } else if (i == 18) {
+        memcpy(configstruct.heartbeat_interval, cfline, strlen(cfline));
+        configstruct.heartbeat_interval_len = strlen(cfline);
+      } else if (i == 19) {
+        memcpy(configstruct.heartbeat_misses, cfline, strlen(cfline));
+        configstruct.heartbeat_misses_len = strlen(cfline);
+      } else if (i == 20) {
+        memcpy(configstruct.adaptive_inquiry, cfline, strlen(cfline));
+        configstruct.adaptive_inquiry_len = strlen(cfline);
+      } else if (i == 21) {
+        memcpy(configstruct.inquiry_min_length, cfline, strlen(cfline));
+        configstruct.inquiry_min_length_len = strlen(cfline);
+      } else if (i == 22) {
+        memcpy(configstruct.inquiry_max_length, cfline, strlen(cfline));
+        configstruct.inquiry_max_length_len = strlen(cfline);
+      } else if (i == 23) {
+        memcpy(configstruct.inquiry_max_gap, cfline, strlen(cfline));
+        configstruct.inquiry_max_gap_len = strlen(cfline);
+      } else if (i == 24) {
+        memcpy(configstruct.trace_events, cfline, strlen(cfline));
+        configstruct.trace_events_len = strlen(cfline);
+      } else if (i == 25) {
+        memcpy(configstruct.trace_file, cfline, strlen(cfline));
+        configstruct.trace_file_len = strlen(cfline);
+      } else if (i == 26) {
+        memcpy(configstruct.analytics_window, cfline, strlen(cfline));
+        configstruct.analytics_window_len = strlen(cfline);
+      } else if (i == 27) {
+        memcpy(configstruct.analytics_salt, cfline, strlen(cfline));
+        configstruct.analytics_salt_len = strlen(cfline);
+      } else if (i == 28) {
+        memcpy(configstruct.suppress_time, cfline, strlen(cfline));
+        configstruct.suppress_time_len = strlen(cfline);
+      } else if (i == 29) {
+        memcpy(configstruct.suppress_fp_rate, cfline, strlen(cfline));
+        configstruct.suppress_fp_rate_len = strlen(cfline);
+      } else if (i == 30) {
+        memcpy(configstruct.suppress_capacity, cfline, strlen(cfline));
+        configstruct.suppress_capacity_len = strlen(cfline);
+      } else if (i == 31) {
+        memcpy(configstruct.zigbee_device, cfline, strlen(cfline));
+        configstruct.zigbee_device_len = strlen(cfline);
+      } else if (i == 32) {
+        memcpy(configstruct.zigbee_baud, cfline, strlen(cfline));
+        configstruct.zigbee_baud_len = strlen(cfline);
+      } else if (i == 33) {
+        memcpy(configstruct.push_profile, cfline, strlen(cfline));
+        configstruct.push_profile_len = strlen(cfline);
+      } else if (i == 34) {
+        memcpy(configstruct.push_dongles, cfline, strlen(cfline));
+        configstruct.push_dongles_len = strlen(cfline);
+      } else if (i == 35) {
+        memcpy(configstruct.advertise_dongle, cfline, strlen(cfline));
+        configstruct.advertise_dongle_len = strlen(cfline);
+      } else if (i == 36) {
+        memcpy(configstruct.analytics_daily_devices, cfline, strlen(cfline));
+        configstruct.analytics_daily_devices_len = strlen(cfline);
+      }
+      i++;
+    }  // End while
+    fclose(file);
+  }  // End if file
+
+  return configstruct;
+}
+
+/*********************************************************************
+ * @fn      get_config_int
+ *
+ * @brief   Convert an optional config value to integer. Config lines
+ *          after RSSI_Coverage may be left out of the config file or
+ *          left empty.
+ *
+ * @param   value: Value read by "@fn get_config"
+ *          value_len: Length of the value, 0 when the line is missing
+ *          default_value: Value used when the line is missing or empty
+ *
+ * @return  Integer value of the config line
+ */
+int get_config_int(char value[], int value_len, int default_value) {
+  if (value_len <= 0 || strspn(value, " \t\r\n") >= (size_t)value_len)
+    return default_value;
+  return atoi(value);
+}
+
+/*********************************************************************
+ * @fn      arena_init
+ *
+ * @brief   Map and populate the memory of an arena up front, so the
+ *          pages are charged to the process at startup instead of
+ *          during busy periods.
+ *
+ * @param   arena: Arena to initialize
+ *          size: Size of the arena in bytes
+ *
+ * @return  0: success
+ *          -1: mapping failed
+ */
+int arena_init(MemArena* arena, size_t size) {
+  void* base;
+
+  arena->used = 0;
+  arena->failed = 0;
+  if (size == 0)
+    return 0;
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (base == MAP_FAILED) {
+    arena->base = NULL;
+    arena->size = 0;
+    return -1;
+  }
+  arena->base = base;
+  arena->size = size;
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      arena_alloc
+ *
+ * @brief   Take a zeroed block from an arena. Blocks are never freed,
+ *          the arena is meant for buffers which live as long as the
+ *          beacon.
+ *
+ * @param   arena: Arena to allocate from
+ *          size: Size of the block in bytes
+ *
+ * @return  Pointer to the block, NULL when the arena is exhausted
+ */
+void* arena_alloc(MemArena* arena, size_t size) {
+  size_t offset = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if (arena->base == NULL || offset + size > arena->size) {
+    arena->failed++;
+    return NULL;
+  }
+  arena->used = offset + size;
+  return arena->base + offset;
+}
+
+/*********************************************************************
+ * @fn      content_preload
+ *
+ * @brief   Load an object of the push profile into the content arena,
+ *          so push threads send it from memory instead of reading the
+ *          file for every user.
+ *
+ * @param   object: Object of the push profile
+ *
+ * @return  0: success
+ *          -1: file can't be read or doesn't fit in the arena
+ */
+int content_preload(PushObject* object) {
+  FILE* file = fopen(object->path, "rb");
+  unsigned char* buffer;
+  long size;
+
+  if (file == NULL) {
+    perror("Can't open push file");
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  buffer = size > 0 ? arena_alloc(&content_arena, size) : NULL;
+  if (buffer == NULL || fread(buffer, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Push file doesn't fit in the content arena\n");
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  object->data = buffer;
+  object->size = (int)size;
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      push_profile_init
+ *
+ * @brief   Read the comma separated objects of Push_Profile, e.g.
+ *          "Push_Profile=location.txt,floor2.jpg,contact.vcf". A name
+ *          is in the directory of the object push file unless it is
+ *          an absolute path. Without a profile the object push file
+ *          is the only object. The size of each object is taken here,
+ *          so that it is known before any push.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  number of objects
+ */
+int push_profile_init(struct config* cfg) {
+  char list[MAXBUF];
+  char* token;
+  char* saveptr = NULL;
+  int dir_len = cfg->filepath_len > 0 ? cfg->filepath_len - 1 : 0;
+  PushObject* object;
+  struct stat info;
+  size_t size;
+  int i;
+
+  push_object_count = 0;
+  memcpy(list, cfg->push_profile, sizeof(list));
+  for (token = strtok_r(list, ",\r\n", &saveptr);
+       token != NULL && push_object_count < MAX_PUSH_OBJECTS;
+       token = strtok_r(NULL, ",\r\n", &saveptr)) {
+    while (isspace((unsigned char)*token))
+      token++;
+    if (*token == '\0')
+      continue;
+    object = &push_objects[push_object_count];
+    size = (*token == '/' ? 0 : dir_len) + strlen(token) + 1;
+    object->path = NULL;
+    if (memory_budget_mode)
+      object->path = arena_alloc(&content_arena, size);
+    if (object->path == NULL)
+      object->path = calloc(1, size);
+    if (*token == '/') {
+      strcpy(object->path, token);
+    } else {
+      memcpy(object->path, cfg->filepath, dir_len);
+      strcpy(object->path + dir_len, token);
+    }
+    push_object_count++;
+  }
+  if (push_object_count == 0) {
+    push_objects[0].path = filepath;
+    push_object_count = 1;
+  }
+  for (i = 0; i < push_object_count; i++) {
+    object = &push_objects[i];
+    object->name = strrchr(object->path, '/');
+    object->name = object->name != NULL ? object->name + 1 : object->path;
+    object->size = stat(object->path, &info) == 0 ? (int)info.st_size : 0;
+  }
+  return push_object_count;
+}
+
+/*********************************************************************
+ * @fn      push_report
+ *
+ * @brief   Print the OBEX sessions with their setup and teardown time,
+ *          and the puts of each object of the push profile.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void push_report() {
+  long long sessions;
+  PushObject* object;
+  int i;
+
+  pthread_mutex_lock(&push_lock);
+  sessions = push_sessions > 0 ? push_sessions : 1;
+  printf("Push profile (%d objects, %lld sessions, %lld failed to connect)\n",
+         push_object_count, push_sessions, push_sessions_failed);
+  printf("  per session: setup %lld ms, teardown %lld ms, %.1f objects sent\n",
+         push_setup_time / sessions, push_teardown_time / sessions,
+         (double)push_objects_sent / sessions);
+  for (i = 0; i < push_object_count; i++) {
+    object = &push_objects[i];
+    printf("  %-24s %8d bytes, %lld sent, %lld failed, put %lld ms\n",
+           object->name, object->size, object->sent, object->failed,
+           object->sent + object->failed > 0
+               ? object->put_time / (object->sent + object->failed)
+               : 0);
+  }
+  pthread_mutex_unlock(&push_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      memory_budget_init
+ *
+ * @brief   Enter memory budget mode when it is enabled in config.
+ *          Push thread stacks and the push content are taken from
+ *          arenas sized by config and allocated at startup, and
+ *          glibc is kept from creating a malloc arena per thread.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  none
+ */
+void memory_budget_init(struct config* cfg) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t stack_size;
+
+  memory_budget_mode =
+      get_config_int(cfg->memory_budget, cfg->memory_budget_len, 0);
+  if (!memory_budget_mode)
+    return;
+
+  stack_size = (size_t)get_config_int(cfg->push_stack_kb,
+                                      cfg->push_stack_kb_len,
+                                      DEFAULT_PUSH_STACK_KB) *
+               1024;
+  if (stack_size < PTHREAD_STACK_MIN)
+    stack_size = PTHREAD_STACK_MIN;
+  push_stack_size = (stack_size + page_size - 1) & ~(size_t)(page_size - 1);
+
+  mallopt(M_ARENA_MAX,
+          get_config_int(cfg->malloc_arena_max, cfg->malloc_arena_max_len,
+                         DEFAULT_MALLOC_ARENA_MAX));
+
+  if (arena_init(&stack_arena, PUSH_SLOTS * push_stack_size) < 0)
+    perror("Can't allocate push stack arena");
+  if (arena_init(&content_arena,
+                 (size_t)get_config_int(cfg->content_arena_kb,
+                                        cfg->content_arena_kb_len,
+                                        DEFAULT_CONTENT_ARENA_KB) *
+                     1024) < 0)
+    perror("Can't allocate content arena");
+}
+
+//  Heap bytes in use, reserved and mapped by glibc. mallinfo2 where
+//  glibc has it (2.33), since the int fields of mallinfo wrap at 2 GB.
+static void heap_info(size_t* in_use, size_t* reserved, size_t* mapped) {
+#if defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 33)
+#define HAVE_MALLINFO2
+#endif
+#endif
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 heap = mallinfo2();
+
+  *in_use = heap.uordblks;
+  *reserved = heap.arena;
+  *mapped = heap.hblkhd;
+#else
+  struct mallinfo heap = mallinfo();
+
+  *in_use = (unsigned)heap.uordblks;
+  *reserved = (unsigned)heap.arena;
+  *mapped = (unsigned)heap.hblkhd;
+#endif
+}
+
+/*********************************************************************
+ * @fn      memory_report
+ *
+ * @brief   Print memory usage of each subsystem: static tables, push
+ *          thread stacks, arenas, heap used by libxbee, obexftp and
+ *          libc, and the totals of the process.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void memory_report() {
+  pthread_attr_t attr;
+  size_t default_stack = 0;
+  size_t heap_in_use, heap_reserved, heap_mapped;
+  char line[MAXBUF * 2];
+  FILE* status;
+  int i, active = 0;
+
+  heap_info(&heap_in_use, &heap_reserved, &heap_mapped);
+  for (i = 0; i < PUSH_SLOTS; i++)
+    if (IdleHandler[i] == 1)
+      active++;
+
+  printf("Memory report (budget mode %s)\n", memory_budget_mode ? "on" : "off");
+  printf("  device queue:     %8zu bytes\n", sizeof(UsedDeviceQueue));
+  printf("  push slot tables: %8zu bytes\n",
+         sizeof(addrbufferlist) + sizeof(IdleHandler) + sizeof(Taddr) +
+             sizeof(thread_id));
+  if (stack_arena.base != NULL) {
+    printf("  push stacks:      %8zu bytes in use, %zu reserved (%d x %zu)\n",
+           active * push_stack_size, stack_arena.size, PUSH_SLOTS,
+           push_stack_size);
+  } else {
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &default_stack);
+    pthread_attr_destroy(&attr);
+    printf("  push stacks:      %8zu bytes virtual (%d x %zu)\n",
+           active * (push_stack_size ? push_stack_size : default_stack),
+           active, push_stack_size ? push_stack_size : default_stack);
+  }
+  printf("  content arena:    %8zu / %zu bytes, %d failed\n", content_arena.used,
+         content_arena.size, content_arena.failed);
+  if (analytics_arena.base != NULL)
+    printf("  analytics arena:  %8zu / %zu bytes, %d failed\n",
+           analytics_arena.used, analytics_arena.size, analytics_arena.failed);
+  else if (return_filter[0] != NULL)
+    printf("  return filter:    %8d bytes\n", 2 * return_filter_bits / 8);
+  if (trace_arena.base != NULL)
+    printf("  trace arena:      %8zu / %zu bytes, %d failed\n",
+           trace_arena.used, trace_arena.size, trace_arena.failed);
+  printf("  heap in use:      %8zu bytes (libxbee, obexftp, libc)\n",
+         heap_in_use);
+  printf("  heap growth:      %8ld bytes since startup\n",
+         (long)heap_in_use - (long)heap_in_use_at_start);
+  printf("  heap reserved:    %8zu bytes, %zu mapped\n", heap_reserved,
+         heap_mapped);
+
+  status = fopen("/proc/self/status", "r");
+  if (status != NULL) {
+    while (fgets(line, sizeof(line), status) != NULL)
+      if (strncmp(line, "VmSize", 6) == 0 || strncmp(line, "VmRSS", 5) == 0 ||
+          strncmp(line, "VmData", 6) == 0 || strncmp(line, "Threads", 7) == 0)
+        printf("  %s", line);
+    fclose(status);
+  }
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      print_status_report
+ *
+ * @brief   Print the report of all subsystems. Requested with SIGUSR1
+ *          and printed by the cleaner thread.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void print_status_report() {
+  startup_report();
+  memory_report();
+  scan_report();
+  inquiry_report();
+  cod_report();
+  adapter_report();
+  push_report();
+  zigbee_report();
+  gateway_report();
+  analytics_report();
+  suppress_report();
+  trace_report();
+}
+
+/*********************************************************************
+ * @fn      report_signal_handler
+ *
+ * @brief   SIGUSR1 handler. Only raises a flag, the report is printed
+ *          outside of the signal context.
+ *
+ * @param   signo: Signal number
+ *
+ * @return  none
+ */
+void report_signal_handler(int signo) {
+  report_requested = 1;
+}
+
+//  Thread name, and the trace it was last written to
+static __thread char trace_thread[18];
+static __thread long long trace_thread_epoch = 0;
+
+//  Release the ring of an exiting thread to the next thread
+static void trace_ring_release(void* ptr) {
+  TraceRing* ring = (TraceRing*)ptr;
+
+  pthread_mutex_lock(&trace_lock);
+  ring->in_use = 0;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/*********************************************************************
+ * @fn      trace_init
+ *
+ * @brief   Read the number of events kept by each thread and the
+ *          file the trace is exported to.
+ *
+ * @param   cfg - config read from the config file
+ *
+ * @return  none
+ */
+void trace_init(struct config* cfg) {
+  char* end;
+
+  trace_ring_size = get_config_int(cfg->trace_events, cfg->trace_events_len,
+                                   DEFAULT_TRACE_EVENTS);
+  if (trace_ring_size <= 0)
+    trace_ring_size = DEFAULT_TRACE_EVENTS;
+  if (cfg->trace_file_len > 0) {
+    memcpy(trace_file, cfg->trace_file, sizeof(trace_file));
+    end = trace_file + strcspn(trace_file, " \r\n");
+    *end = '\0';
+    if (trace_file[0] == '\0')
+      strcpy(trace_file, DEFAULT_TRACE_FILE);
+  }
+  pthread_key_create(&trace_key, trace_ring_release);
+}
+
+long long trace_now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/*********************************************************************
+ * @fn      trace_event
+ *
+ * @brief   Record a trace event in the ring of the calling thread. The
+ *          first event of a thread takes a free ring, so threads never
+ *          contend for one and the memory is bounded by
+ *          TRACE_MAX_RINGS rings of Trace_Events events. Called
+ *          through the TRACE_* macros, which skip it while tracing is
+ *          off.
+ *
+ * @param   name - static name of the span or instant
+ *          addr - Bluetooth address the event belongs to, or NULL
+ *          ts - start time (us of "@fn trace_now")
+ *          dur - duration (us), or TRACE_INSTANT_DUR
+ *          arg - number shown with the event, e.g. RSSI or slot
+ *
+ * @return  none
+ */
+void trace_event(const char* name,
+                 const char* addr,
+                 long long ts,
+                 long long dur,
+                 int arg) {
+  static __thread int tid = 0;
+  TraceRing* ring = pthread_getspecific(trace_key);
+  TraceEvent* event;
+  int i;
+
+  if (ring == NULL) {
+    pthread_mutex_lock(&trace_lock);
+    for (i = 0; i < trace_ring_count && ring == NULL; i++)
+      if (!trace_rings[i].in_use)
+        ring = &trace_rings[i];
+    if (ring == NULL && trace_ring_count < TRACE_MAX_RINGS) {
+      ring = &trace_rings[trace_ring_count];
+      ring->events = NULL;
+      if (memory_budget_mode)
+        ring->events =
+            arena_alloc(&trace_arena, trace_ring_size * sizeof(TraceEvent));
+      if (ring->events == NULL)
+        ring->events = calloc(trace_ring_size, sizeof(TraceEvent));
+      if (ring->events != NULL)
+        trace_ring_count++;
+      else
+        ring = NULL;
+    }
+    if (ring != NULL)
+      ring->in_use = 1;
+    pthread_mutex_unlock(&trace_lock);
+    if (ring == NULL) {
+      __sync_add_and_fetch(&trace_dropped, 1);
+      return;
+    }
+    pthread_setspecific(trace_key, ring);
+  }
+  if (tid == 0)
+    tid = (int)syscall(SYS_gettid);
+  //  Name the thread once in each trace
+  if (trace_thread_epoch != trace_epoch && dur != TRACE_THREAD_NAME) {
+    trace_thread_epoch = trace_epoch;
+    if (trace_thread[0] != '\0')
+      trace_event("thread_name", trace_thread, ts, TRACE_THREAD_NAME, 0);
+  }
+
+  event = &ring->events[ring->head % trace_ring_size];
+  event->name = name;
+  if (addr != NULL)
+    snprintf(event->addr, sizeof(event->addr), "%s", addr);
+  else
+    event->addr[0] = '\0';
+  event->tid = tid;
+  event->arg = arg;
+  event->ts = ts;
+  event->dur = dur;
+  __sync_synchronize();
+  ring->head++;
+}
+
+void trace_event_bdaddr(const char* name,
+                        bdaddr_t* bdaddr,
+                        long long ts,
+                        long long dur,
+                        int arg) {
+  char addr[18];
+
+  ba2str(bdaddr, addr);
+  trace_event(name, addr, ts, dur, arg);
+}
+
+//  Name the calling thread in the trace, e.g. "push slot 3"
+void trace_thread_name(const char* name) {
+  snprintf(trace_thread, sizeof(trace_thread), "%s", name);
+}
+
+/*********************************************************************
+ * @fn      trace_start
+ *
+ * @brief   Empty the rings and start tracing.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void trace_start() {
+  int i;
+
+  pthread_mutex_lock(&trace_lock);
+  //  In budget mode the rings are mapped the first time tracing starts,
+  //  so a beacon which never traces doesn't pay for them
+  if (memory_budget_mode && trace_arena.base == NULL &&
+      arena_init(&trace_arena, (size_t)TRACE_ARENA_RINGS * trace_ring_size *
+                                   sizeof(TraceEvent)) < 0)
+    perror("Can't allocate trace arena");
+  for (i = 0; i < trace_ring_count; i++)
+    trace_rings[i].head = 0;
+  trace_dropped = 0;
+  trace_epoch = trace_now();
+  pthread_mutex_unlock(&trace_lock);
+  trace_enabled = 1;
+  printf("Tracing started, %d events per thread\n", trace_ring_size);
+}
+
+/*********************************************************************
+ * @fn      trace_stop
+ *
+ * @brief   Stop tracing and export the events kept to the trace file.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void trace_stop() {
+  trace_enabled = 0;
+  if (trace_export(trace_file) == 0)
+    printf("Trace written to %s\n", trace_file);
+}
+
+/*********************************************************************
+ * @fn      trace_export
+ *
+ * @brief   Write the events of every ring as Chrome trace JSON, which
+ *          chrome://tracing and the Perfetto UI open. Spans are
+ *          complete ("X") events, and each carries the Bluetooth
+ *          address and its number in "args".
+ *
+ * @param   path - file to write
+ *
+ * @return  0: written
+ *          -1: the file can't be written
+ */
+int trace_export(const char* path) {
+  FILE* file = fopen(path, "w");
+  TraceEvent* event;
+  unsigned long long first, n;
+  int i, count = 0;
+
+  if (file == NULL) {
+    perror("Can't write trace");
+    return -1;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  pthread_mutex_lock(&trace_lock);
+  for (i = 0; i < trace_ring_count; i++) {
+    TraceRing* ring = &trace_rings[i];
+    first = ring->head > (unsigned long long)trace_ring_size
+                ? ring->head - trace_ring_size
+                : 0;
+    for (n = first; n < ring->head; n++) {
+      event = &ring->events[n % trace_ring_size];
+      fprintf(file, "%s{\"pid\":1,\"tid\":%d,", count++ ? ",\n" : "",
+              event->tid);
+      if (event->dur == TRACE_THREAD_NAME)
+        fprintf(file,
+                "\"ph\":\"M\",\"name\":\"thread_name\","
+                "\"args\":{\"name\":\"%s\"}}",
+                event->addr);
+      else if (event->dur == TRACE_INSTANT_DUR)
+        fprintf(file,
+                "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"ts\":%lld,"
+                "\"args\":{\"addr\":\"%s\",\"value\":%d}}",
+                event->name, event->ts - trace_epoch, event->addr, event->arg);
+      else
+        fprintf(file,
+                "\"ph\":\"X\",\"name\":\"%s\",\"ts\":%lld,\"dur\":%lld,"
+                "\"args\":{\"addr\":\"%s\",\"value\":%d}}",
+                event->name, event->ts - trace_epoch, event->dur, event->addr,
+                event->arg);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0 ? 0 : -1;
+}
+
+/*********************************************************************
+ * @fn      trace_report
+ *
+ * @brief   Print whether tracing is on, the rings in use, and the
+ *          events kept, overwritten and dropped.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void trace_report() {
+  unsigned long long events = 0, overwritten = 0;
+  int i;
+
+  pthread_mutex_lock(&trace_lock);
+  for (i = 0; i < trace_ring_count; i++) {
+    events += trace_rings[i].head;
+    if (trace_rings[i].head > (unsigned long long)trace_ring_size)
+      overwritten += trace_rings[i].head - trace_ring_size;
+  }
+  printf("Trace report (%s, %s)\n", trace_enabled ? "on" : "off", trace_file);
+  printf("  %d rings of %d events, %zu KB\n", trace_ring_count,
+         trace_ring_size,
+         trace_ring_count * trace_ring_size * sizeof(TraceEvent) / 1024);
+  printf("  %llu events, %llu overwritten, %lld dropped\n", events,
+         overwritten, trace_dropped);
+  pthread_mutex_unlock(&trace_lock);
+  fflush(NULL);
+}
+
+void trace_signal_handler(int signo) {
+  trace_toggle_requested = 1;
+}
+
+/*********************************************************************
+ * @fn      wait_gateway_bindCB
+ *
+ * @brief   Callback of @fn wait_gateway_bind.
+ *          when Lbeacon start ZigBee will wait for
+ *          Gateway to bind with.
+ *
+ * @param   xbee: Name of config file
+ *          con: Get Lbeacon connection info
+ *          pkt: received data and address from gateway
+ *          data:
+ *
+ * @return  none
+ */
+void wait_gateway_bindCB(struct xbee* xbee,
+                         struct xbee_con* con,
+                         struct xbee_pkt** pkt,
+                         void** data) {
+  if ((*pkt)->dataLen > 0) {
+    printf("rx: %d bytes, cmd 0x%02X\n", (*pkt)->dataLen, (*pkt)->data[0]);
+    gateway_heard(&(*pkt)->address);
+    parse_packet((*pkt)->data, (*pkt)->dataLen, (*pkt)->address);
+  }
+}
+
+/*********************************************************************
+ * @fn      wait_gateway_bind
+ *
+ * @brief   Wait the binding request from gateway.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+int wait_gateway_bind() {
+  int n;
+  int len;
+  struct xbee_conAddress address;
+  unsigned char buffer[16];
+  xbee_err ret;
+  memset(&address, 0, sizeof(address));
+  address.addr64_enabled = 1;
+  address.addr64[0] = 0x00;
+  address.addr64[1] = 0x00;
+  address.addr64[2] = 0x00;
+  address.addr64[3] = 0x00;
+  address.addr64[4] = 0x00;
+  address.addr64[5] = 0x00;
+  address.addr64[6] = 0xFF;
+  address.addr64[7] = 0xFF;
+  if ((ret = xbee_conNew(xbee, &con, "Data", &address)) != XBEE_ENONE) {
+    xbee_log(xbee, -1, "xbee_conNew() returned: %d (%s)", ret,
+             xbee_errorToStr(ret));
+    return ret;
+  }
+
+  if ((ret = xbee_conCallbackSet(con, wait_gateway_bindCB, NULL)) !=
+      XBEE_ENONE) {
+    xbee_log(xbee, -1, "xbee_conCallbackSet() returned: %d", ret);
+    return ret;
+  }
+
+  /* getting an ACK for a broadcast message is kinda pointless... */
+  xbee_conSettings(con, NULL, &settings);
+  settings.disableAck = 1;
+  xbee_conSettings(con, &settings, NULL);
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      rcvCB
+ *
+ * @brief   receive data from gateway
+ *
+ * @param   xbee: Name of config file
+ *          con: Get Lbeacon connection info
+ *          pkt: received data and address from gateway
+ *          data:
+ *
+ * @return  none
+ */
+void rcvCB(struct xbee* xbee,
+           struct xbee_con* con,
+           struct xbee_pkt** pkt,
+           void** data) {
+  if ((*pkt)->dataLen > 0) {
+    printf("rx: %d bytes, cmd 0x%02X\n", (*pkt)->dataLen, (*pkt)->data[0]);
+    gateway_heard(&(*pkt)->address);
+    parse_packet((*pkt)->data, (*pkt)->dataLen, (*pkt)->address);
+  }
+}
+
+//  Find a gateway in the ranked list. An unknown one takes the last
+//  rank only while no Gateway_List is configured, -1 otherwise
+static int gateway_rank(unsigned char addr64[8]) {
+  int i;
+
+  for (i = 0; i < gateway_count; i++)
+    if (memcmp(gateways[i].addr64, addr64, 8) == 0)
+      return i;
+  if (gateway_listed > 0)
+    return -1;
+  if (gateway_count < MAX_GATEWAYS)
+    gateway_count++;
+  i = gateway_count - 1;
+  memset(&gateways[i], 0, sizeof(gateways[i]));
+  memcpy(gateways[i].addr64, addr64, 8);
+  return i;
+}
+
+/*********************************************************************
+ * @fn      bind_gateway
+ *
+ * @brief   When "@fn wait_gateway_bind" got request from gateway
+ *          it will send the address via "@fn parse_packet"
+ *          to this function and then bind with gateway. Binding to
+ *          another gateway ends the connection to the previous one.
+ *
+ * @param   address: Gateway's ZigBee Mac address
+ *
+ * @return  error event
+ */
+int bind_gateway(struct xbee_conAddress address) {
+  struct xbee_con* new_con;
+  struct xbee_con* old_con;
+  xbee_err ret;
+  int rank;
+  address.addr64_enabled = 1;
+
+  pthread_mutex_lock(&gateway_lock);
+  rank = gateway_rank(address.addr64);
+  if (rank < 0) {
+    pthread_mutex_unlock(&gateway_lock);
+    printf("Gateway not in Gateway_List, not bound\n");
+    return -1;
+  }
+  if (g_con != NULL && rank == gateway_current) {
+    //  Bound already, a repeated request only restarts the heartbeat
+    gateway_missed = 0;
+    pthread_mutex_unlock(&gateway_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&gateway_lock);
+
+  if ((ret = xbee_conNew(xbee, &new_con, "Data", &address)) != XBEE_ENONE) {
+    xbee_log(xbee, -1, "xbee_conNew() returned: %d (%s)", ret,
+             xbee_errorToStr(ret));
+    return ret;
+  }
+
+  if ((ret = xbee_conDataSet(new_con, xbee, NULL)) != XBEE_ENONE) {
+    xbee_log(xbee, -1, "xbee_conDataSet() returned: %d", ret);
+    xbee_conEnd(new_con);
+    return ret;
+  }
+
+  if ((ret = xbee_conCallbackSet(new_con, rcvCB, NULL)) != XBEE_ENONE) {
+    xbee_log(xbee, -1, "xbee_conCallbackSet() returned: %d", ret);
+    xbee_conEnd(new_con);
+    return ret;
+  }
+
+  pthread_mutex_lock(&gateway_lock);
+  old_con = g_con;
+  g_con = new_con;
+  gateway_current = rank;
+  gateway_attempt = rank;
+  gateway_missed = 0;
+  //  The new gateway gets a full interval before its first miss
+  gateways[rank].last_rx = getSystemTime();
+  pthread_mutex_unlock(&gateway_lock);
+  if (old_con != NULL)
+    xbee_conEnd(old_con);
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      gateway_heard
+ *
+ * @brief   Note a frame received from a gateway. A frame of the bound
+ *          gateway resets the missed heartbeats, ends a failover and
+ *          resends the messages kept in the outbox.
+ *
+ * @param   address: ZigBee address of the sender
+ *
+ * @return  none
+ */
+void gateway_heard(struct xbee_conAddress* address) {
+  long long now = getSystemTime();
+  long long elapsed;
+
+  pthread_mutex_lock(&gateway_lock);
+  if (gateway_current < 0 ||
+      memcmp(gateways[gateway_current].addr64, address->addr64, 8) != 0) {
+    pthread_mutex_unlock(&gateway_lock);
+    return;
+  }
+  gateways[gateway_current].last_rx = now;
+  gateway_missed = 0;
+  if (failover_started > 0) {
+    elapsed = now - failover_started;
+    failover_started = 0;
+    recoveries++;
+    recover_last = elapsed;
+    recover_total += elapsed;
+    if (elapsed > recover_max)
+      recover_max = elapsed;
+    printf("Gateway %d recovered in %lld ms\n", gateway_current, elapsed);
+  }
+  outbox_flush();
+  pthread_mutex_unlock(&gateway_lock);
+}
+
+//  Bind the gateway after the current one in the ranked list. Only
+//  leaving a bound gateway starts a failover, the binds at startup
+//  aren't counted
+static void gateway_failover() {
+  struct xbee_conAddress address;
+  struct xbee_con* old_con;
+  int next, counted;
+
+  pthread_mutex_lock(&gateway_lock);
+  if (gateway_count == 0) {
+    pthread_mutex_unlock(&gateway_lock);
+    return;
+  }
+  counted = gateway_current >= 0 || failover_started > 0;
+  if (gateway_current >= 0)
+    gateways[gateway_current].failures++;
+  next = (gateway_attempt + 1) % gateway_count;
+  gateway_attempt = next;
+  if (counted) {
+    if (failover_started == 0)
+      failover_started = getSystemTime();
+    failovers++;
+  }
+  old_con = g_con;
+  g_con = NULL;
+  gateway_current = -1;
+  memset(&address, 0, sizeof(address));
+  address.addr64_enabled = 1;
+  memcpy(address.addr64, gateways[next].addr64, 8);
+  pthread_mutex_unlock(&gateway_lock);
+
+  printf(counted ? "Gateway failover to %d\n" : "Binding gateway %d\n", next);
+  if (old_con != NULL)
+    xbee_conEnd(old_con);
+  bind_gateway(address);
+}
+
+//  Read a 64-bit ZigBee address written as 16 hex digits
+static int parse_addr64(char* text, unsigned char addr64[8]) {
+  char byte[3] = {0};
+  int i;
+
+  if (strlen(text) != 16)
+    return -1;
+  for (i = 0; i < 8; i++) {
+    if (!isxdigit((unsigned char)text[2 * i]) ||
+        !isxdigit((unsigned char)text[2 * i + 1]))
+      return -1;
+    byte[0] = text[2 * i];
+    byte[1] = text[2 * i + 1];
+    addr64[i] = (unsigned char)strtol(byte, NULL, 16);
+  }
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      gateway_init
+ *
+ * @brief   Read the ranked list of gateway addresses, e.g.
+ *          "0013A20040A1B2C3,0013A20040A1B2C4", and the heartbeat
+ *          settings from config. With a list, a gateway outside it
+ *          can't bind LBeacon.
+ *
+ * @param   cfg: Config read by "@fn get_config"
+ *
+ * @return  none
+ */
+void gateway_init(struct config* cfg) {
+  char list[MAXBUF];
+  char *token, *saveptr = NULL;
+  unsigned char addr64[8];
+
+  memcpy(list, cfg->gateway_list, sizeof(list));
+  for (token = strtok_r(list, ", \r\n", &saveptr); token != NULL;
+       token = strtok_r(NULL, ", \r\n", &saveptr)) {
+    if (parse_addr64(token, addr64) < 0)
+      fprintf(stderr, "Invalid gateway address: %s\n", token);
+    else
+      gateway_rank(addr64);
+  }
+  gateway_listed = gateway_count;
+  heartbeat_interval = get_config_int(cfg->heartbeat_interval,
+                                      cfg->heartbeat_interval_len, 0);
+  heartbeat_misses =
+      get_config_int(cfg->heartbeat_misses, cfg->heartbeat_misses_len,
+                     DEFAULT_HEARTBEAT_MISSES);
+}
+
+/*********************************************************************
+ * @fn      gateway_monitor
+ *
+ * @brief   Thread of the gateway heartbeat. Binds the first gateway of
+ *          the list when none is bound, then sends a heartbeat every
+ *          heartbeat_interval ms. An interval without any frame from
+ *          the gateway counts as a miss, and after heartbeat_misses
+ *          misses the next gateway of the list is bound.
+ *
+ * @param   ptr: none
+ *
+ * @return  none
+ */
+void* gateway_monitor(void* ptr) {
+  int missed, bound;
+
+  while (1) {
+    pthread_mutex_lock(&gateway_lock);
+    bound = g_con != NULL;
+    missed = 0;
+    if (bound) {
+      if (getSystemTime() - gateways[gateway_current].last_rx >
+          heartbeat_interval)
+        gateway_missed++;
+      missed = gateway_missed >= heartbeat_misses;
+      if (!missed && zigbee_transmit(g_con, CMD_HEARTBEAT, NULL, 0) < 0)
+        gateway_missed++;
+    }
+    pthread_mutex_unlock(&gateway_lock);
+
+    if (missed || (!bound && gateway_count > 0))
+      gateway_failover();
+    usleep(heartbeat_interval * 1000);
+  }
+}
+
+/*********************************************************************
+ * @fn      gateway_report
+ *
+ * @brief   Print the bound gateway, failovers, time to recover and
+ *          the outbox.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void gateway_report() {
+  long long now = getSystemTime();
+  int i, j;
+
+  pthread_mutex_lock(&gateway_lock);
+  printf("Gateway report (heartbeat %lld ms, %d misses)\n", heartbeat_interval,
+         heartbeat_misses);
+  for (i = 0; i < gateway_count; i++) {
+    printf("  %c ", i == gateway_current ? '*' : ' ');
+    for (j = 0; j < 8; j++)
+      printf("%02X", gateways[i].addr64[j]);
+    printf(": last heard %lld ms ago, %d failures\n",
+           gateways[i].last_rx ? now - gateways[i].last_rx : -1,
+           gateways[i].failures);
+  }
+  printf("  %lld failovers, %lld recovered, recover last %lld ms, max %lld "
+         "ms, mean %lld ms\n",
+         failovers, recoveries, recover_last, recover_max,
+         recoveries ? recover_total / recoveries : 0);
+  printf("  outbox: %d waiting, %lld resent, %lld dropped\n", outbox_count,
+         outbox_resent, outbox_dropped);
+  pthread_mutex_unlock(&gateway_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      zigbee_init
+ *
+ * @brief   Initialize ZigBee Device.
+ *
+ * @param   none
+ *
+ * @return  error event
+ */
+int zigbee_init() {
+  xbee_err ret;
+  if ((ret = xbee_setup(&xbee, "xbee2", zigbee_device, zigbee_baud)) !=
+      XBEE_ENONE) {
+    printf("ret: %d (%s)\n", ret, xbee_errorToStr(ret));
+    return ret;
+  }
+  return 0;
+}
+
+/*********************************************************************
+ * Codec benchmark: throughput of the ZigBee frame codec and its
+ * behaviour on noise, corrupted frames and reordered fragments.
+ */
+static long long bench_messages;
+static long long bench_bytes;
+static long long bench_mismatch;
+static const unsigned char* bench_expected;
+static int bench_expected_len;
+
+static void bench_count(PacketContext* ctx, unsigned char* data, int len) {
+  bench_messages++;
+  bench_bytes += len;
+}
+
+static void bench_check(PacketContext* ctx, unsigned char* data, int len) {
+  bench_messages++;
+  if (len != bench_expected_len || memcmp(data, bench_expected, len) != 0)
+    bench_mismatch++;
+}
+
+//  Encode a message into frames, return the number of frames
+static int bench_frames(struct Packet* frames,
+                        int* sizes,
+                        unsigned int seq,
+                        const unsigned char* message,
+                        int len) {
+  int count = (len + PACKET_DATA_SIZE - 1) / PACKET_DATA_SIZE;
+  int i, chunk;
+
+  for (i = 0; i < count; i++) {
+    chunk = len - i * PACKET_DATA_SIZE;
+    if (chunk > PACKET_DATA_SIZE)
+      chunk = PACKET_DATA_SIZE;
+    sizes[i] = packet_encode(&frames[i], 'd', seq, i, count,
+                             message + i * PACKET_DATA_SIZE, chunk);
+  }
+  return count;
+}
+
+static double bench_seconds(struct timespec* begin) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/*********************************************************************
+ * @fn      packet_benchmark
+ *
+ * @brief   Run each phase for CODEC_BENCH_TIME ms and print its result:
+ *          encode and decode throughput on messages of random size,
+ *          random noise, frames with flipped bits, and messages whose
+ *          fragments arrive out of order. Noise and corrupted frames
+ *          must not be accepted.
+ *
+ * @param   none
+ *
+ * @return  0: no corrupted frame was accepted and every message
+ *             came out intact
+ *          1: the codec accepted a corrupted frame or lost a message
+ */
+int packet_benchmark() {
+  static PacketHandler count_handlers[256], check_handlers[256];
+  static unsigned char message[PACKET_MAX_MESSAGE];
+  struct Packet frames[PACKET_MAX_FRAGMENTS];
+  int sizes[PACKET_MAX_FRAGMENTS], order[PACKET_MAX_FRAGMENTS];
+  unsigned char noise[PACKET_HEADER_SIZE + PACKET_DATA_SIZE + 16];
+  struct xbee_conAddress address;
+  struct timespec begin;
+  long long sent = 0, frame_count = 0, accepted, bad = 0;
+  unsigned int seq = 0;
+  double seconds;
+  int i, j, len, count, tmp;
+
+  for (i = 0; i < 256; i++) {
+    count_handlers[i] = bench_count;
+    check_handlers[i] = bench_check;
+  }
+  for (i = 0; i < PACKET_MAX_MESSAGE; i++)
+    message[i] = i * 31 + 7;
+  memset(&address, 0, sizeof(address));
+  srandom(1);
+  zigbee_legacy = 0;
+
+  //  Throughput
+  memset(&packet_stats, 0, sizeof(packet_stats));
+  bench_messages = bench_bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while ((seconds = bench_seconds(&begin)) * 1000 < CODEC_BENCH_TIME) {
+    for (j = 0; j < 1000; j++) {
+      len = 1 + random() % PACKET_MAX_MESSAGE;
+      count = bench_frames(frames, sizes, seq, message, len);
+      for (i = 0; i < count; i++)
+        packet_receive(count_handlers, (unsigned char*)&frames[i], sizes[i],
+                       &address);
+      frame_count += count;
+      seq = (seq + 1) & 0xFFFF;
+      sent++;
+    }
+  }
+  printf("Throughput: %.0f messages/s, %.0f frames/s, %.2f MB/s payload\n",
+         bench_messages / seconds, frame_count / seconds,
+         bench_bytes / seconds / 1e6);
+  if (bench_messages != sent) {
+    printf("  %lld of %lld messages lost\n", sent - bench_messages, sent);
+    bad++;
+  }
+
+  //  Random noise
+  memset(&packet_stats, 0, sizeof(packet_stats));
+  bench_messages = frame_count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while (bench_seconds(&begin) * 1000 < CODEC_BENCH_TIME) {
+    for (j = 0; j < 1000; j++, frame_count++) {
+      len = random() % sizeof(noise);
+      for (i = 0; i < len; i++)
+        noise[i] = random();
+      //  Half of the noise has a valid header, only the CRC catches it
+      if (len >= (int)PACKET_HEADER_SIZE &&
+          len <= (int)(PACKET_HEADER_SIZE + PACKET_DATA_SIZE) &&
+          random() % 2) {
+        ((struct Packet*)noise)->version = PACKET_VERSION;
+        ((struct Packet*)noise)->frag_index = 0;
+        ((struct Packet*)noise)->frag_count = 1;
+        ((struct Packet*)noise)->data_len = len - PACKET_HEADER_SIZE;
+      }
+      packet_receive(count_handlers, noise, len, &address);
+    }
+  }
+  accepted = packet_stats.frames;
+  //  A valid header passes the CRC by chance once in 65536
+  printf("Noise: %lld inputs, %lld accepted (%lld bad length, %lld bad "
+         "version, %lld bad CRC)\n",
+         frame_count, accepted, packet_stats.bad_length,
+         packet_stats.bad_version, packet_stats.bad_crc);
+
+  //  Flipped bits
+  memset(&packet_stats, 0, sizeof(packet_stats));
+  bench_messages = frame_count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while (bench_seconds(&begin) * 1000 < CODEC_BENCH_TIME) {
+    for (j = 0; j < 1000; j++, frame_count++) {
+      len = 1 + random() % PACKET_DATA_SIZE;
+      bench_frames(frames, sizes, seq, message, len);
+      seq = (seq + 1) & 0xFFFF;
+      //  One to three distinct bits
+      count = 1 + random() % 3;
+      for (i = 0; i < count; i++) {
+        do {
+          order[i] = random() % (sizes[0] * 8);
+          for (tmp = 0; tmp < i && order[tmp] != order[i]; tmp++)
+            ;
+        } while (tmp < i);
+        ((unsigned char*)&frames[0])[order[i] / 8] ^= 1 << (order[i] % 8);
+      }
+      packet_receive(count_handlers, (unsigned char*)&frames[0], sizes[0],
+                     &address);
+    }
+  }
+  printf("Flipped bits: %lld frames, %lld accepted\n", frame_count,
+         packet_stats.frames);
+  if (packet_stats.frames > 0)
+    bad++;
+
+  //  Fragments out of order, every message must come out intact
+  memset(&packet_stats, 0, sizeof(packet_stats));
+  bench_messages = bench_mismatch = sent = 0;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while (bench_seconds(&begin) * 1000 < CODEC_BENCH_TIME) {
+    for (j = 0; j < 1000; j++, sent++) {
+      len = 1 + random() % PACKET_MAX_MESSAGE;
+      bench_expected = message + random() % (PACKET_MAX_MESSAGE - len + 1);
+      bench_expected_len = len;
+      count = bench_frames(frames, sizes, seq, bench_expected, len);
+      seq = (seq + 1) & 0xFFFF;
+      for (i = 0; i < count; i++)
+        order[i] = i;
+      for (i = count - 1; i > 0; i--) {
+        tmp = random() % (i + 1);
+        int swap = order[i];
+        order[i] = order[tmp];
+        order[tmp] = swap;
+      }
+      for (i = 0; i < count; i++)
+        packet_receive(check_handlers, (unsigned char*)&frames[order[i]],
+                       sizes[order[i]], &address);
+    }
+  }
+  printf("Reordered: %lld messages, %lld delivered, %lld corrupted\n", sent,
+         bench_messages, bench_mismatch);
+  if (bench_messages != sent || bench_mismatch > 0)
+    bad++;
+
+  return bad > 0;
+}
+
+/*********************************************************************
+ * Load generator: a simulated crowd fed through the real inquiry
+ * parsing, dedup and dispatch, with a stand-in push transport.
+ */
+static double sim_uniform() {
+  return (random() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static void sim_addr(unsigned int id, bdaddr_t* bdaddr) {
+  bdaddr->b[0] = id & 0xFF;
+  bdaddr->b[1] = (id >> 8) & 0xFF;
+  bdaddr->b[2] = (id >> 16) & 0xFF;
+  bdaddr->b[3] = (id >> 24) & 0xFF;
+  bdaddr->b[4] = 0;
+  bdaddr->b[5] = SIM_ADDR_MARK;
+}
+
+static unsigned int sim_id_of(const char* address) {
+  bdaddr_t bdaddr;
+
+  str2ba(address, &bdaddr);
+  return bdaddr.b[0] | bdaddr.b[1] << 8 | bdaddr.b[2] << 16 |
+         (unsigned int)bdaddr.b[3] << 24;
+}
+
+//  Whether a device accepts Object Push is fixed by its identity
+static int sim_has_opp(unsigned int id) {
+  return (id * 2654435761u) % 100 >= (unsigned int)load_model.no_opp;
+}
+
+static SimDevice* sim_find(unsigned int id) {
+  int i;
+
+  for (i = 0; i < MAX_SIM_DEVICES; i++)
+    if (sim_devices[i].used && sim_devices[i].id == id)
+      return &sim_devices[i];
+  return NULL;
+}
+
+//  Stand-in Push dongle of the push thread
+static __thread int sim_dev = -1;
+
+static int sim_attach(int dev_id) {
+  sim_dev = dev_id;
+  return sim_adapter_alive(dev_id) ? dev_id : -1;
+}
+
+static void sim_detach(int handle) {}
+
+static int sim_browse(const char* address) {
+  unsigned int id = sim_id_of(address);
+  SimDevice* device;
+
+  pthread_mutex_lock(&load_lock);
+  load_stats.pushes_started++;
+  device = sim_find(id);
+  if (device != NULL)
+    device->pushing = 1;
+  pthread_mutex_unlock(&load_lock);
+  usleep(load_model.browse_ms * 1000);
+  return sim_has_opp(id) ? 9 : -1;
+}
+
+static void* sim_open() {
+  return &load_model;
+}
+
+static int sim_connect(void* cli, const char* address, int channel) {
+  usleep(load_model.connect_ms * 1000);
+  return channel < 0 || !sim_adapter_alive(sim_dev) ? -1 : 0;
+}
+
+static int sim_put(void* cli,
+                   const char* path,
+                   const unsigned char* data,
+                   int size,
+                   const char* name) {
+  usleep(load_model.put_ms * 1000);
+  return sim_adapter_alive(sim_dev) ? 0 : -1;
+}
+
+static int sim_disconnect(void* cli) {
+  return 0;
+}
+
+static void sim_close(void* cli) {}
+
+static void sim_finished(const char* address, int result) {
+  long long now = getSystemTime();
+  SimDevice* device;
+  long long bucket;
+
+  pthread_mutex_lock(&load_lock);
+  device = sim_find(sim_id_of(address));
+  if (result < 0) {
+    load_stats.pushes_failed++;
+  } else {
+    load_stats.pushes_ok++;
+    if (device != NULL && device->in_range_since > 0) {
+      bucket = (now - device->in_range_since) / LATENCY_BUCKET;
+      load_stats.latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+    }
+  }
+  if (device != NULL) {
+    device->pushing = 0;
+    device->pushed = 1;
+  }
+  pthread_mutex_unlock(&load_lock);
+}
+
+PushTransport sim_transport = {"simulated", sim_attach,     sim_detach,
+                               sim_browse,  sim_open,       sim_connect,
+                               sim_put,     sim_disconnect, sim_close,
+                               sim_finished};
+
+//  Add an arriving device, either new or a repeat visitor
+static void loadgen_arrive(long long now) {
+  SimDevice* device = NULL;
+  unsigned int id;
+  int i;
+
+  for (i = 0; i < MAX_SIM_DEVICES && device == NULL; i++)
+    if (!sim_devices[i].used)
+      device = &sim_devices[i];
+  if (device == NULL)
+    return;
+
+  id = sim_next_id;
+  if (sim_next_id > 0 && random() % 100 < load_model.repeat &&
+      sim_find(id = random() % sim_next_id) == NULL) {
+    load_stats.repeats++;
+  } else {
+    id = sim_next_id++;
+  }
+  memset(device, 0, sizeof(*device));
+  device->used = 1;
+  device->id = id;
+  device->arrival = now;
+  device->departure =
+      now + (long long)(-log(sim_uniform()) * load_model.dwell * 1000);
+  device->rssi = load_model.rssi + (int)(random() % 11) - 5;
+  load_stats.arrivals++;
+  if (!sim_has_opp(id))
+    load_stats.no_opp++;
+}
+
+//  Walk the population for one tick and collect its inquiry results,
+//  none when results is NULL because no inquiry runs
+static int loadgen_tick(long long now, inquiry_info_with_rssi* results) {
+  double chance = (double)LOADGEN_TICK / load_model.seen;
+  int step = load_model.rssi_step;
+  int i, count = 0, waiting = 0;
+
+  for (i = 0; i < MAX_SIM_DEVICES; i++) {
+    SimDevice* device = &sim_devices[i];
+    if (!device->used)
+      continue;
+    if (now >= device->departure) {
+      if (device->in_range_since > 0 && !device->pushed && !device->pushing)
+        load_stats.dropped++;
+      load_stats.departures++;
+      device->used = 0;
+      continue;
+    }
+    if (device->in_range_since > 0 && !device->pushed && !device->pushing)
+      waiting++;
+    if (results == NULL || sim_uniform() >= chance)
+      continue;
+
+    device->rssi += (int)(random() % (2 * step + 1)) - step;
+    if (device->rssi > -30)
+      device->rssi = -30;
+    if (device->rssi < -100)
+      device->rssi = -100;
+    if (device->rssi > RSSI_RANGE && device->in_range_since == 0)
+      device->in_range_since = now;
+
+    memset(&results[count], 0, sizeof(results[count]));
+    sim_addr(device->id, &results[count].bdaddr);
+    results[count].rssi = device->rssi;
+    //  Devices without OPP are headsets, the others smartphones
+    results[count].dev_class[0] = sim_has_opp(device->id) ? 0x0C : 0x04;
+    results[count].dev_class[1] = sim_has_opp(device->id) ? 0x02 : 0x04;
+    results[count].dev_class[2] = sim_has_opp(device->id) ? 0x5A : 0x24;
+    count++;
+  }
+
+  load_stats.waiting_last = waiting;
+  if (waiting > load_stats.waiting_max)
+    load_stats.waiting_max = waiting;
+  return count;
+}
+
+//  Feed inquiry results as HCI events through the real parser
+static void loadgen_feed(ScanAdapter* adapter,
+                         inquiry_info_with_rssi* results,
+                         int count) {
+  unsigned char buf[HCI_MAX_EVENT_SIZE];
+  int per_event = (sizeof(buf) - 4) / sizeof(*results);
+  struct timespec begin, end;
+  int sent, n;
+
+  for (sent = 0; sent < count; sent += n) {
+    n = count - sent < per_event ? count - sent : per_event;
+    buf[0] = HCI_EVENT_PKT;
+    buf[1] = EVT_INQUIRY_RESULT_WITH_RSSI;
+    buf[2] = 1 + n * sizeof(*results);
+    buf[3] = n;
+    memcpy(buf + 4, &results[sent], n * sizeof(*results));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    scanner_process_event(adapter, buf, 4 + n * sizeof(*results));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    load_stats.parse_us += (end.tv_sec - begin.tv_sec) * 1000000LL +
+                           (end.tv_nsec - begin.tv_nsec) / 1000;
+  }
+  load_stats.results += count;
+}
+
+static int latency_percentile(int percent) {
+  long long total = 0, count = 0;
+  int i;
+
+  for (i = 0; i <= LATENCY_BUCKETS; i++)
+    total += load_stats.latency[i];
+  if (total == 0)
+    return 0;
+  for (i = 0; i <= LATENCY_BUCKETS; i++) {
+    count += load_stats.latency[i];
+    if (count * 100 >= total * percent)
+      break;
+  }
+  return (i + 1) * LATENCY_BUCKET;
+}
+
+/*********************************************************************
+ * @fn      loadgen_parse
+ *
+ * @brief   Read the population model of the load generator from a
+ *          comma separated list, e.g. "rate=5000,dwell=30,noopp=40".
+ *          rate: arrivals per minute, dwell: mean dwell time (s),
+ *          rssi/step: RSSI on arrival and its walk per result,
+ *          noopp/repeat: % of devices without OPP and of repeat
+ *          visitors, seen: mean ms between two results of a device,
+ *          duration: length of the test (s), browse/connect/put: ms
+ *          taken by each step of the stand-in push.
+ *
+ * @param   options: Option argument of "-L"
+ *
+ * @return  0: success
+ *          -1: unknown or invalid option
+ */
+int loadgen_parse(char* options) {
+  char* const tokens[] = {"rate",     "dwell",  "rssi",    "step",
+                          "noopp",    "repeat", "seen",    "duration",
+                          "browse",   "connect", "put",    "outage",
+                          "outage_len", NULL};
+  int* fields[] = {&load_model.arrival_rate, &load_model.dwell,
+                   &load_model.rssi,         &load_model.rssi_step,
+                   &load_model.no_opp,       &load_model.repeat,
+                   &load_model.seen,         &load_model.duration,
+                   &load_model.browse_ms,    &load_model.connect_ms,
+                   &load_model.put_ms,       &load_model.outage,
+                   &load_model.outage_ms};
+  char* value;
+  int index;
+
+  while (*options != '\0') {
+    index = getsubopt(&options, tokens, &value);
+    //  An unknown option comes back whole in value
+    if (index < 0) {
+      fprintf(stderr, "Unknown load option: %s\n", value);
+      return -1;
+    }
+    if (value == NULL) {
+      fprintf(stderr, "Load option %s needs a value\n", tokens[index]);
+      return -1;
+    }
+    *fields[index] = atoi(value);
+  }
+  if (load_model.arrival_rate <= 0 || load_model.dwell <= 0 ||
+      load_model.seen <= 0 || load_model.rssi_step < 0 ||
+      load_model.outage < 0 || load_model.outage_ms <= 0) {
+    fprintf(stderr, "Invalid load model\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      loadgen_report
+ *
+ * @brief   Print the results of the load test.
+ *
+ * @param   elapsed: Length of the test (ms)
+ *
+ * @return  none
+ */
+void loadgen_report(long long elapsed) {
+  double seconds = elapsed / 1000.0;
+
+  pthread_mutex_lock(&load_lock);
+  printf("Load test report (%.0f s)\n", seconds);
+  printf("  population: %d/min, dwell %d s, RSSI %d step %d, %d%% no OPP, "
+         "%d%% repeat\n",
+         load_model.arrival_rate, load_model.dwell, load_model.rssi,
+         load_model.rssi_step, load_model.no_opp, load_model.repeat);
+  printf("  arrivals:   %lld (%lld repeat, %lld no OPP), %lld left\n",
+         load_stats.arrivals, load_stats.repeats, load_stats.no_opp,
+         load_stats.departures);
+  printf("  throughput: %lld inquiry results (%.1f/s), %.2f us per result\n",
+         load_stats.results, load_stats.results / seconds,
+         load_stats.results ? (double)load_stats.parse_us / load_stats.results
+                            : 0);
+  printf("  pushes:     %lld started (%.1f/min), %lld ok, %lld failed\n",
+         load_stats.pushes_started, load_stats.pushes_started * 60 / seconds,
+         load_stats.pushes_ok, load_stats.pushes_failed);
+  printf("  dropped:    %lld devices left in range without a push\n",
+         load_stats.dropped);
+  if (load_model.outage > 0)
+    printf("  outages:    %lld of a Push dongle, every %d s for %d ms\n",
+           load_stats.outages, load_model.outage, load_model.outage_ms);
+  printf("  waiting:    %d after 1 min, %d at end, %d max (%+.1f/min)\n",
+         load_stats.waiting_first, load_stats.waiting_last,
+         load_stats.waiting_max,
+         seconds > 60 ? (load_stats.waiting_last - load_stats.waiting_first) /
+                            (seconds / 60 - 1)
+                      : 0);
+  printf("  latency:    p50 %d ms, p90 %d ms, p99 %d ms\n",
+         latency_percentile(50), latency_percentile(90),
+         latency_percentile(99));
+  pthread_mutex_unlock(&load_lock);
+  print_status_report();
+}
+
+//  Unplug a stand-in Push dongle every outage s, the dongles in turn,
+//  and plug it back in after outage_ms. A dongle known by address comes
+//  back at another device ID, as a USB dongle may.
+static void loadgen_outage(long long now, long long start) {
+  static long long next = 0, back = 0;
+  static int dongle = 0, unplugged = -1, by_address = 0;
+  static bdaddr_t bdaddr;
+  AdapterRole* adapter;
+  int dev_id, up;
+
+  if (load_model.outage <= 0)
+    return;
+  if (next == 0)
+    next = start + load_model.outage * 1000LL;
+  if (unplugged >= 0 && now >= back) {
+    dev_id = unplugged;
+    if (by_address)
+      for (dev_id = HCI_MAX_DEV - 1;
+           dev_id > 0 && (dev_id == unplugged || sim_adapters[dev_id].used);
+           dev_id--)
+        ;
+    sim_adapter_event(HCI_DEV_REG, dev_id, &bdaddr);
+    unplugged = -1;
+    dongle = (dongle + 1) % PUSHDONGLES;
+  }
+  if (unplugged < 0 && now >= next) {
+    next += load_model.outage * 1000LL;
+    pthread_mutex_lock(&adapter_lock);
+    adapter = adapter_find(ADAPTER_PUSH, dongle);
+    dev_id = adapter != NULL ? adapter->dev_id : -1;
+    by_address = adapter != NULL && adapter->by_address;
+    pthread_mutex_unlock(&adapter_lock);
+    if (dev_id < 0 || sim_adapter_info(dev_id, &bdaddr, &up) < 0)
+      return;
+    sim_adapter_event(HCI_DEV_DOWN, dev_id, NULL);
+    sim_adapter_event(HCI_DEV_UNREG, dev_id, NULL);
+    unplugged = dev_id;
+    back = now + load_model.outage_ms;
+    pthread_mutex_lock(&load_lock);
+    load_stats.outages++;
+    pthread_mutex_unlock(&load_lock);
+  }
+}
+
+/*********************************************************************
+ * @fn      loadgen_run
+ *
+ * @brief   Run the load generator in place of the Scan dongles. Every
+ *          LOADGEN_TICK ms devices arrive and leave according to the
+ *          population model, and the devices present produce inquiry
+ *          results which go through "@fn scanner_process_event".
+ *          Inquiries follow the schedule of the Scan dongle, so no
+ *          results come in the gaps between them. Pushes run on the
+ *          stand-in transport.
+ *
+ * @param   none
+ *
+ * @return  0 when the test is done
+ */
+int loadgen_run() {
+  static inquiry_info_with_rssi results[MAX_SIM_DEVICES];
+  ScanAdapter* adapter = &scan_adapters[0];
+  long long start = getSystemTime(), now = start;
+  long long next_arrival = start, next_progress = start + 10000;
+  long long inquiry_start = start, resume = start;
+  int count, responses = 0, inquiring = 0;
+
+  push_transport = &sim_transport;
+  trace_thread_name("load generator");
+  scan_adapter_count = 1;
+  adapter->index = 0;
+  adapter->start_time = start;
+  srandom((unsigned int)start);
+  printf("Load test: %d devices/min for %d s\n", load_model.arrival_rate,
+         load_model.duration);
+
+  while (now - start < load_model.duration * 1000LL) {
+    pthread_mutex_lock(&load_lock);
+    while (next_arrival <= now) {
+      loadgen_arrive(now);
+      next_arrival +=
+          (long long)(-log(sim_uniform()) * 60000 / load_model.arrival_rate);
+    }
+    if (!inquiring && now >= resume) {
+      inquiring = 1;
+      inquiry_start = now;
+      responses = 0;
+      inquiry_schedule_start(adapter);
+    }
+    count = loadgen_tick(now, inquiring ? results : NULL);
+    if (now - start < 60000)
+      load_stats.waiting_first = load_stats.waiting_last;
+    pthread_mutex_unlock(&load_lock);
+
+    //  The lock is released first, push threads take it when they finish
+    loadgen_feed(adapter, results, count);
+    loadgen_outage(now, start);
+
+    //  Inquiry ends after its length or its number of responses
+    responses += count;
+    if (inquiring &&
+        (now - inquiry_start >= adapter->schedule.length * 1280LL ||
+         (adapter->schedule.num_rsp > 0 &&
+          responses >= adapter->schedule.num_rsp))) {
+      inquiring = 0;
+      adapter->inquiries++;
+      inquiry_schedule_update(adapter, now - inquiry_start);
+      resume = now + adapter->schedule.gap;
+    }
+
+    if (now >= next_progress) {
+      printf("Load test: %lld s, %lld arrivals, %lld pushes, %d waiting\n",
+             (now - start) / 1000, load_stats.arrivals,
+             load_stats.pushes_started, load_stats.waiting_last);
+      next_progress += 10000;
+    }
+    usleep(LOADGEN_TICK * 1000);
+    now = getSystemTime();
+  }
+  loadgen_report(now - start);
+  return 0;
+}
+
+//  Lose a frame with the probability of the loss option
+static int gwsim_lost() {
+  return gwsim_model.loss > 0 && random() % 100 < gwsim_model.loss;
+}
+
+//  Whether a simulated gateway is down: the backup when not simulated,
+//  the primary during the scripted outage
+static int gwsim_down(int gateway, long long now) {
+  long long from = gwsim_start + gwsim_model.outage * 1000000LL;
+
+  if (gateway == 1)
+    return !gwsim_model.backup;
+  return gwsim_model.outage > 0 && gwsim_start > 0 && now >= from &&
+         (gwsim_model.outage_len == 0 ||
+          now < from + gwsim_model.outage_len * 1000000LL);
+}
+
+//  Take the time the bytes need on a serial line of the emulated speed
+static void gwsim_pace(int bytes) {
+  if (gwsim_model.baud > 0)
+    usleep((long long)bytes * 10 * 1000000 / gwsim_model.baud);
+}
+
+//  Write an API frame: start, length, frame data and checksum
+static int gwsim_write_frame(const unsigned char* data, int len) {
+  unsigned char buf[XBEE_MAX_FRAME + 4];
+  unsigned char sum = 0;
+  int i, ret;
+
+  if (len > XBEE_MAX_FRAME)
+    return -1;
+  buf[0] = XBEE_START;
+  buf[1] = len >> 8;
+  buf[2] = len & 0xFF;
+  for (i = 0; i < len; i++) {
+    buf[3 + i] = data[i];
+    sum += data[i];
+  }
+  buf[3 + len] = 0xFF - sum;
+  pthread_mutex_lock(&gwsim_write_lock);
+  gwsim_pace(len + 4);
+  ret = write(gwsim_fd, buf, len + 4) == len + 4 ? 0 : -1;
+  pthread_mutex_unlock(&gwsim_write_lock);
+  pthread_mutex_lock(&gwsim_lock);
+  gwsim_stats.bytes_out += len + 4;
+  pthread_mutex_unlock(&gwsim_lock);
+  return ret;
+}
+
+//  Send a message of a simulated gateway to LBeacon, one Receive Packet
+//  frame for each of its ZigBee frames
+static void gwsim_send_message(int gateway,
+                               unsigned char cmd,
+                               const unsigned char* data,
+                               int len) {
+  unsigned char frame[XBEE_MAX_FRAME];
+  struct Packet* packet = (struct Packet*)(frame + 12);
+  int count = len > 0 ? (len + PACKET_DATA_SIZE - 1) / PACKET_DATA_SIZE : 1;
+  unsigned int seq = __sync_fetch_and_add(&gwsim_seq, 1) & 0xFFFF;
+  int i, chunk, size, lost;
+
+  frame[0] = XBEE_RX_PACKET;
+  memcpy(frame + 1, gwsim_addr64[gateway], 8);
+  frame[9] = 0xFF;  //  16 bit address unknown
+  frame[10] = 0xFE;
+  frame[11] = 0x01;  //  acknowledged
+  for (i = 0; i < count; i++) {
+    chunk = len - i * PACKET_DATA_SIZE;
+    if (chunk > PACKET_DATA_SIZE)
+      chunk = PACKET_DATA_SIZE;
+    size = packet_encode(packet, cmd, seq, i, count,
+                         data + i * PACKET_DATA_SIZE, chunk);
+    lost = gwsim_lost();
+    pthread_mutex_lock(&gwsim_lock);
+    gwsim_stats.frames_out++;
+    if (lost)
+      gwsim_stats.dropped_out++;
+    pthread_mutex_unlock(&gwsim_lock);
+    if (!lost)
+      gwsim_write_frame(frame, 12 + size);
+  }
+}
+
+//  A simulated gateway receives a ZigBee frame of LBeacon
+static void gwsim_gateway_receive(int gateway, unsigned char* data, int len) {
+  struct Packet* packet = packet_decode(data, len);
+  unsigned int token;
+  long long rtt, now = trace_now();
+  int i;
+
+  pthread_mutex_lock(&gwsim_lock);
+  if (packet == NULL) {
+    gwsim_stats.bad_frames++;
+  } else if (packet->CMD == CMD_HEALTH_REPLY && packet->data_len >= 4) {
+    token = (unsigned int)packet->data[0] << 24 | packet->data[1] << 16 |
+            packet->data[2] << 8 | packet->data[3];
+    for (i = 0; i < GWSIM_MAX_WINDOW; i++)
+      if (gwsim_requests[i].used && gwsim_requests[i].token == token)
+        break;
+    if (i == GWSIM_MAX_WINDOW) {
+      //  Its request was given up as lost
+      gwsim_stats.late++;
+    } else {
+      gwsim_requests[i].used = 0;
+      rtt = now - gwsim_requests[i].sent;
+      gwsim_stats.replies++;
+      gwsim_stats.rtt_total += rtt;
+      if (rtt > gwsim_stats.rtt_max)
+        gwsim_stats.rtt_max = rtt;
+      gwsim_stats.rtt[rtt / 1000 < GWSIM_RTT_BUCKETS ? rtt / 1000
+                                                     : GWSIM_RTT_BUCKETS]++;
+    }
+  } else if (packet->CMD == CMD_HEARTBEAT) {
+    gwsim_stats.heartbeats++;
   } else {
-    dev_id = PUSH_DONGLE_A;
+    gwsim_stats.other++;
   }
-  sock = hci_open_dev(dev_id);
-  if (dev_id < 0 || sock < 0) {
-    perror("opening socket");
-    pthread_exit(NULL);
+  pthread_mutex_unlock(&gwsim_lock);
+  //  The gateway answers each heartbeat
+  if (packet != NULL && packet->CMD == CMD_HEARTBEAT)
+    gwsim_send_message(gateway, CMD_HEARTBEAT, NULL, 0);
+}
+
+//  The simulated radio handles an API frame from LBeacon's libxbee
+static void gwsim_handle_frame(unsigned char* data, int len) {
+  unsigned char reply[7];
+  int lost, down, gateway;
+
+  switch (data[0]) {
+    case XBEE_AT_COMMAND:
+      //  Every AT command of the local radio succeeds
+      if (len < 4)
+        break;
+      reply[0] = XBEE_AT_RESPONSE;
+      reply[1] = data[1];
+      reply[2] = data[2];
+      reply[3] = data[3];
+      reply[4] = 0;
+      pthread_mutex_lock(&gwsim_lock);
+      gwsim_stats.at_commands++;
+      pthread_mutex_unlock(&gwsim_lock);
+      gwsim_write_frame(reply, 5);
+      break;
+
+    case XBEE_TX_REQUEST:
+      //  Frame id, 64 and 16 bit address, radius, options, RF data
+      if (len < 14) {
+        pthread_mutex_lock(&gwsim_lock);
+        gwsim_stats.bad_frames++;
+        pthread_mutex_unlock(&gwsim_lock);
+        break;
+      }
+      //  A gateway which is down doesn't acknowledge
+      gateway = memcmp(data + 2, gwsim_addr64[1], 8) == 0 ? 1 : 0;
+      down = gwsim_down(gateway, trace_now());
+      lost = down || gwsim_lost();
+      pthread_mutex_lock(&gwsim_lock);
+      gwsim_stats.frames_in++;
+      if (down)
+        gwsim_stats.outage_dropped++;
+      else if (lost)
+        gwsim_stats.dropped_in++;
+      else
+        gwsim_active = gateway;
+      pthread_mutex_unlock(&gwsim_lock);
+      if (data[1] != 0) {
+        reply[0] = XBEE_TX_STATUS;
+        reply[1] = data[1];
+        reply[2] = 0xFF;
+        reply[3] = 0xFE;
+        reply[4] = 0;
+        reply[5] = lost ? 0x01 : 0x00;  //  MAC ACK failure or success
+        reply[6] = 0;
+        gwsim_write_frame(reply, 7);
+      }
+      if (!lost)
+        gwsim_gateway_receive(gateway, data + 14, len - 14);
+      break;
+
+    default:
+      pthread_mutex_lock(&gwsim_lock);
+      gwsim_stats.other++;
+      pthread_mutex_unlock(&gwsim_lock);
   }
-  printf("Thread number %d\n", Pigs->threadId);
-  // pthread_exit(0);
-  gettimeofday(&start, NULL);
-  long long start1 = getSystemTime();
-  address = (char*)Pigs->addr;
-  channel = obexftp_browse_bt_push(address); /*!!!*/
-  /* Extract basename from file path */
-  filename = strrchr(filepath, '/');
-  if (!filename)
-    filename = filepath;
-  else
-    filename++;
-  printf("Sending file %s to %s\n", filename, address);
-  /* Open connection */
-  cli = obexftp_open(OBEX_TRANS_BLUETOOTH, NULL, NULL, NULL); /*!!!*/
-  long long end1 = getSystemTime();
+}
 
-  printf("time: %lld ms\n", end1 - start1);
-  if (cli == NULL) {
-    fprintf(stderr, "Error opening obexftp client\n");
-    IdleHandler[Pigs->threadId] = 0;
-    for (i = 0; i < 18; i++) {
-      addrbufferlist[Pigs->threadId][i] = 0;
+//  Read the API frames LBeacon's libxbee writes to the pty
+static void* gwsim_reader(void* ptr) {
+  unsigned char buf[256], frame[XBEE_MAX_FRAME];
+  unsigned char sum = 0;
+  int n, i, state = 0, need = 0, got = 0;
+
+  while ((n = read(gwsim_fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      break;
     }
+    gwsim_pace(n);
+    pthread_mutex_lock(&gwsim_lock);
+    gwsim_stats.bytes_in += n;
+    pthread_mutex_unlock(&gwsim_lock);
+    for (i = 0; i < n; i++) {
+      switch (state) {
+        case 0:
+          if (buf[i] == XBEE_START)
+            state = 1;
+          break;
+        case 1:
+          need = buf[i] << 8;
+          state = 2;
+          break;
+        case 2:
+          need |= buf[i];
+          got = 0;
+          sum = 0;
+          state = need > 0 && need <= XBEE_MAX_FRAME ? 3 : 0;
+          break;
+        case 3:
+          frame[got++] = buf[i];
+          sum += buf[i];
+          if (got == need)
+            state = 4;
+          break;
+        case 4:
+          if ((unsigned char)(sum + buf[i]) == 0xFF) {
+            gwsim_handle_frame(frame, need);
+          } else {
+            pthread_mutex_lock(&gwsim_lock);
+            gwsim_stats.bad_frames++;
+            pthread_mutex_unlock(&gwsim_lock);
+          }
+          state = 0;
+          break;
+      }
+    }
+  }
+  return NULL;
+}
 
-    close(sock);
-    pthread_exit(NULL);
+static int gwsim_percentile(int percent) {
+  long long total = 0, count = 0;
+  int i;
+
+  for (i = 0; i <= GWSIM_RTT_BUCKETS; i++)
+    total += gwsim_stats.rtt[i];
+  if (total == 0)
+    return 0;
+  for (i = 0; i <= GWSIM_RTT_BUCKETS; i++) {
+    count += gwsim_stats.rtt[i];
+    if (count * 100 >= total * percent)
+      break;
   }
-  /* Connect to device */
-  ret = obexftp_connect_push(cli, address, channel); /*!!!*/
+  return i + 1;
+}
 
-  if (ret < 0) {
-    fprintf(stderr, "Error connecting to obexftp device\n");
-    obexftp_close(cli);
-    cli = NULL;
-    IdleHandler[Pigs->threadId] = 0;
-    for (i = 0; i < 18; i++) {
-      addrbufferlist[Pigs->threadId][i] = 0;
+/*********************************************************************
+ * @fn      gwsim_parse
+ *
+ * @brief   Read the script of the gateway simulator from a comma
+ *          separated list, e.g. "rate=20,window=4,loss=5".
+ *          rate: health requests per second, 0 as fast as the window
+ *          allows, window: requests waiting for a reply at most,
+ *          duration: length of the benchmark (s), loss: % of frames
+ *          lost in each direction, content/content_rate: bytes and
+ *          rate of content messages, baud: serial speed emulated,
+ *          outage/outage_len: time (s) the primary gateway goes silent
+ *          and for how long, backup: 1 for a backup gateway to fail
+ *          over to.
+ *
+ * @param   options: Option argument of "-G"
+ *
+ * @return  0: success
+ *          -1: unknown or invalid option
+ */
+int gwsim_parse(char* options) {
+  char* const tokens[] = {"rate",    "window",       "duration", "loss",
+                          "content", "content_rate", "baud",     "outage",
+                          "outage_len", "backup",    NULL};
+  int* fields[] = {&gwsim_model.rate,       &gwsim_model.window,
+                   &gwsim_model.duration,   &gwsim_model.loss,
+                   &gwsim_model.content,    &gwsim_model.content_rate,
+                   &gwsim_model.baud,       &gwsim_model.outage,
+                   &gwsim_model.outage_len, &gwsim_model.backup};
+  char* value;
+  int index;
+
+  while (*options != '\0') {
+    index = getsubopt(&options, tokens, &value);
+    //  An unknown option comes back whole in value
+    if (index < 0) {
+      fprintf(stderr, "Unknown gateway simulator option: %s\n", value);
+      return -1;
     }
-    close(sock);
-    pthread_exit(NULL);
+    if (value == NULL) {
+      fprintf(stderr, "Gateway simulator option %s needs a value\n",
+              tokens[index]);
+      return -1;
+    }
+    *fields[index] = atoi(value);
+  }
+  if (gwsim_model.rate < 0 || gwsim_model.window < 1 ||
+      gwsim_model.window > GWSIM_MAX_WINDOW || gwsim_model.duration <= 0 ||
+      gwsim_model.loss < 0 || gwsim_model.loss > 100 ||
+      gwsim_model.content < 0 || gwsim_model.content > PACKET_MAX_MESSAGE ||
+      gwsim_model.content_rate < 0 || gwsim_model.baud < 0 ||
+      gwsim_model.outage < 0 || gwsim_model.outage_len < 0 ||
+      gwsim_model.backup < 0 || gwsim_model.backup > 1) {
+    fprintf(stderr, "Invalid gateway simulator script\n");
+    return -1;
   }
+  return 0;
+}
 
-  /* Push file */
-  ret = obexftp_put_file(cli, filepath, filename); /*!!!*/
-  if (ret < 0) {
-    fprintf(stderr, "Error putting file\n");
+/*********************************************************************
+ * @fn      gwsim_report
+ *
+ * @brief   Print the round-trip latency, throughput and losses of the
+ *          gateway simulator, followed by the ZigBee report, and by the
+ *          gateway report with the time to recover when an outage was
+ *          scripted.
+ *
+ * @param   elapsed: Length of the benchmark (ms)
+ *
+ * @return  none
+ */
+void gwsim_report(long long elapsed) {
+  double seconds = elapsed / 1000.0;
+
+  pthread_mutex_lock(&gwsim_lock);
+  printf("Gateway simulator report (%.0f s, %d%% loss, %d baud)\n", seconds,
+         gwsim_model.loss, gwsim_model.baud);
+  printf("  requests:   %lld health, %lld replies (%.1f/s), %lld lost, "
+         "%lld late\n",
+         gwsim_stats.requests, gwsim_stats.replies,
+         gwsim_stats.replies / seconds, gwsim_stats.lost, gwsim_stats.late);
+  printf("  latency:    avg %.1f ms, p50 %d ms, p90 %d ms, p99 %d ms, "
+         "max %.1f ms\n",
+         gwsim_stats.replies ? gwsim_stats.rtt_total / 1000.0 /
+                                   gwsim_stats.replies
+                             : 0,
+         gwsim_percentile(50), gwsim_percentile(90), gwsim_percentile(99),
+         gwsim_stats.rtt_max / 1000.0);
+  printf("  content:    %lld messages of %d bytes\n", gwsim_stats.content,
+         gwsim_model.content);
+  printf("  frames:     %lld to LBeacon (%lld lost), %lld from LBeacon "
+         "(%lld lost), %lld bad\n",
+         gwsim_stats.frames_out, gwsim_stats.dropped_out,
+         gwsim_stats.frames_in, gwsim_stats.dropped_in,
+         gwsim_stats.bad_frames);
+  printf("  serial:     %lld bytes out (%.0f B/s), %lld bytes in (%.0f B/s)\n",
+         gwsim_stats.bytes_out, gwsim_stats.bytes_out / seconds,
+         gwsim_stats.bytes_in, gwsim_stats.bytes_in / seconds);
+  printf("  other:      %lld AT commands, %lld heartbeats, %lld other\n",
+         gwsim_stats.at_commands, gwsim_stats.heartbeats, gwsim_stats.other);
+  if (gwsim_model.outage > 0)
+    printf("  outage:     primary down from %d s for %d s, %lld frames "
+           "unanswered, backup %s, %s gateway active\n",
+           gwsim_model.outage,
+           gwsim_model.outage_len > 0
+               ? gwsim_model.outage_len
+               : (int)(seconds - gwsim_model.outage),
+           gwsim_stats.outage_dropped, gwsim_model.backup ? "on" : "off",
+           gwsim_active ? "backup" : "primary");
+  pthread_mutex_unlock(&gwsim_lock);
+  zigbee_report();
+  if (gwsim_model.outage > 0)
+    gateway_report();
+}
+
+//  Give up the requests waiting longer than GWSIM_TIMEOUT, and return
+//  the number still waiting and a free request in slot
+static int gwsim_expire(long long now, int* slot) {
+  int i, waiting = 0;
+
+  *slot = -1;
+  pthread_mutex_lock(&gwsim_lock);
+  for (i = 0; i < GWSIM_MAX_WINDOW; i++) {
+    if (gwsim_requests[i].used &&
+        now - gwsim_requests[i].sent > GWSIM_TIMEOUT * 1000LL) {
+      gwsim_requests[i].used = 0;
+      gwsim_stats.lost++;
+    }
+    if (gwsim_requests[i].used)
+      waiting++;
+    else if (*slot == -1)
+      *slot = i;
   }
+  pthread_mutex_unlock(&gwsim_lock);
+  return waiting;
+}
 
-  /* Disconnect */
-  ret = obexftp_disconnect(cli); /*!!!*/
-  if (ret < 0) {
-    fprintf(stderr, "Error disconnecting the client\n");
+/*********************************************************************
+ * @fn      gwsim_run
+ *
+ * @brief   Run LBeacon's ZigBee side against a simulated gateway. A
+ *          pty pair stands in for the serial line: LBeacon's libxbee
+ *          opens the slave end through "@fn zigbee_init", and the
+ *          simulator plays the local radio and the remote gateway on
+ *          the master end in XBee API frames. It binds LBeacon, then
+ *          sends health requests carrying a token, which LBeacon
+ *          echoes, and content messages by the script. Frames are lost
+ *          in both directions by the loss option. Requests come from
+ *          the gateway LBeacon sent to last, and none while it is down,
+ *          so a scripted outage of the primary shows how long LBeacon
+ *          takes to fail over to the backup.
+ *
+ * @param   none
+ *
+ * @return  0 when the benchmark is done
+ *          1: the pty or ZigBee can't start
+ */
+int gwsim_run() {
+  unsigned char data[PACKET_MAX_MESSAGE];
+  struct termios tio;
+  pthread_t reader, monitor;
+  long long start, now, next_request, next_content, deadline;
+  unsigned int token = 0;
+  int i, slot, slave, active;
+  char* path;
+
+  gwsim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (gwsim_fd < 0 || grantpt(gwsim_fd) < 0 || unlockpt(gwsim_fd) < 0 ||
+      (path = ptsname(gwsim_fd)) == NULL ||
+      (slave = open(path, O_RDWR | O_NOCTTY)) < 0) {
+    perror("Can't open pty");
+    return 1;
   }
-  /* Close */
-  obexftp_close(cli); /*!!!*/
-  cli = NULL;
-  IdleHandler[Pigs->threadId] = 0;
-  for (i = 0; i < 18; i++) {
-    addrbufferlist[Pigs->threadId][i] = 0;
+  //  Raw like a serial line, and held open so the master never sees EOF
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  snprintf(zigbee_device, sizeof(zigbee_device), "%s", path);
+  srandom((unsigned int)getSystemTime());
+  //  The simulated gateways replace Gateway_List
+  gateway_count = 0;
+  gateway_listed = 0;
+  gateway_rank(gwsim_addr64[0]);
+  if (gwsim_model.backup)
+    gateway_rank(gwsim_addr64[1]);
+  gateway_listed = gateway_count;
+  if (gwsim_model.outage > 0 && heartbeat_interval <= 0) {
+    printf("No Heartbeat_Interval, outage detected by a %d ms heartbeat\n",
+           GWSIM_HEARTBEAT);
+    heartbeat_interval = GWSIM_HEARTBEAT;
+  }
+  pthread_create(&reader, NULL, gwsim_reader, NULL);
+  printf("Gateway simulator on %s\n", zigbee_device);
+
+  if (zigbee_init() != 0 || wait_gateway_bind() != 0) {
+    fprintf(stderr, "ZigBee doesn't start on %s\n", zigbee_device);
+    return 1;
+  }
+  //  Bind, repeated since the request may be lost
+  deadline = getSystemTime() + 5 * GWSIM_TIMEOUT;
+  while (g_con == NULL && getSystemTime() < deadline) {
+    gwsim_send_message(0, CMD_BIND, NULL, 0);
+    usleep(200000);
+  }
+  if (g_con == NULL) {
+    fprintf(stderr, "LBeacon didn't bind the simulated gateway\n");
+    return 1;
+  }
+  if (heartbeat_interval > 0)
+    pthread_create(&monitor, NULL, gateway_monitor, NULL);
+
+  start = trace_now();
+  gwsim_start = start;
+  next_request = start;
+  next_content = start;
+  for (i = 0; i < gwsim_model.content; i++)
+    data[i] = (unsigned char)i;
+  while ((now = trace_now()) - start < gwsim_model.duration * 1000000LL) {
+    pthread_mutex_lock(&gwsim_lock);
+    active = gwsim_active;
+    pthread_mutex_unlock(&gwsim_lock);
+    if (gwsim_down(active, now)) {
+      gwsim_expire(now, &slot);
+      usleep(1000);
+      continue;
+    }
+    if (gwsim_expire(now, &slot) < gwsim_model.window && slot != -1 &&
+        now >= next_request) {
+      token++;
+      pthread_mutex_lock(&gwsim_lock);
+      gwsim_requests[slot].token = token;
+      gwsim_requests[slot].sent = now;
+      gwsim_requests[slot].used = 1;
+      gwsim_stats.requests++;
+      pthread_mutex_unlock(&gwsim_lock);
+      data[0] = token >> 24;
+      data[1] = token >> 16;
+      data[2] = token >> 8;
+      data[3] = token;
+      gwsim_send_message(active, CMD_HEALTH, data, 4);
+      for (i = 0; i < 4 && i < gwsim_model.content; i++)
+        data[i] = (unsigned char)i;
+      next_request =
+          gwsim_model.rate > 0 ? next_request + 1000000 / gwsim_model.rate : 0;
+      continue;
+    }
+    if (gwsim_model.content > 0 && gwsim_model.content_rate > 0 &&
+        now >= next_content) {
+      gwsim_send_message(active, CMD_SWITCH, data, gwsim_model.content);
+      pthread_mutex_lock(&gwsim_lock);
+      gwsim_stats.content++;
+      pthread_mutex_unlock(&gwsim_lock);
+      next_content += 1000000 / gwsim_model.content_rate;
+      continue;
+    }
+    usleep(200);
+  }
+
+  //  Replies still on the way
+  deadline = trace_now() + GWSIM_TIMEOUT * 1000LL;
+  while (gwsim_expire(trace_now(), &slot) > 0 && trace_now() < deadline)
+    usleep(1000);
+  gwsim_report((trace_now() - start) / 1000);
+  close(slave);
+  return 0;
+}
+
+/*********************************************************************
+ * @fn      analytics_init
+ *
+ * @brief   Read the analytics window and the salt of the address
+ *          hash. Analytics stays off without a site salt in config,
+ *          since unsalted hashes of addresses can be reversed and a
+ *          random salt stops the gateway from merging unique devices
+ *          across beacons. The filter of devices seen before is sized
+ *          for the unique devices expected in a day,
+ *          m = -n ln(p) / ln(2)^2 bits.
+ *
+ * @param   cfg - config read from the config file
+ *
+ * @return  none
+ */
+void analytics_init(struct config* cfg) {
+  char salt[MAXBUF];
+  size_t len;
+  double bits;
+  int devices, i;
+
+  analytics_window = get_config_int(cfg->analytics_window,
+                                    cfg->analytics_window_len,
+                                    DEFAULT_ANALYTICS_WINDOW) *
+                     1000LL;
+  memcpy(salt, cfg->analytics_salt, sizeof(salt));
+  salt[strcspn(salt, "\r\n")] = '\0';
+  len = strlen(salt);
+  if (len > 0) {
+    memcpy(analytics_salt, salt,
+           len < ANALYTICS_SALT_SIZE ? len : ANALYTICS_SALT_SIZE);
+    analytics_salted = 1;
+  } else if (analytics_window > 0) {
+    fprintf(stderr, "No Analytics_Salt configured, analytics disabled\n");
+    analytics_window = 0;
+  }
+  devices = get_config_int(cfg->analytics_daily_devices,
+                           cfg->analytics_daily_devices_len,
+                           DEFAULT_ANALYTICS_DAILY_DEVICES);
+  if (devices <= 0)
+    devices = DEFAULT_ANALYTICS_DAILY_DEVICES;
+  bits = -devices * log(RETURN_FILTER_FP_RATE / 100) / (M_LN2 * M_LN2);
+  return_filter_bits = bits < 64 ? 64 : bits > RETURN_FILTER_MAX_BITS
+                                            ? RETURN_FILTER_MAX_BITS
+                                            : ((int)bits + 7) / 8 * 8;
+  return_filter_hashes =
+      (int)((double)return_filter_bits / devices * M_LN2 + 0.5);
+  if (return_filter_hashes < 1)
+    return_filter_hashes = 1;
+  if (return_filter_hashes > 16)
+    return_filter_hashes = 16;
+  //  Its own arena, so Content_Arena_KB stays sized for the push objects
+  if (memory_budget_mode && analytics_window > 0 &&
+      arena_init(&analytics_arena,
+                 2 * (((size_t)return_filter_bits / 8 + ARENA_ALIGN - 1) &
+                      ~(size_t)(ARENA_ALIGN - 1))) < 0)
+    perror("Can't allocate analytics arena");
+  for (i = 0; i < 2 && analytics_window > 0; i++) {
+    if (memory_budget_mode)
+      return_filter[i] = arena_alloc(&analytics_arena, return_filter_bits / 8);
+    if (return_filter[i] == NULL)
+      return_filter[i] = calloc(1, return_filter_bits / 8);
+    if (return_filter[i] == NULL) {
+      perror("Can't allocate the return filter, analytics disabled");
+      analytics_window = 0;
+    }
+  }
+  analytics_window_start = getSystemTime();
+  return_filter_rotated = analytics_window_start;
+}
+
+/*********************************************************************
+ * @fn      analytics_hash
+ *
+ * @brief   Hash an address with the salt, FNV-1a followed by the
+ *          splitmix64 finalizer, so analytics never holds an address.
+ *
+ * @param   bdaddr - Bluetooth address
+ *
+ * @return  64 bit hash
+ */
+unsigned long long analytics_hash(bdaddr_t* bdaddr) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i = 0; i < ANALYTICS_SALT_SIZE; i++)
+    hash = (hash ^ analytics_salt[i]) * 0x100000001b3ULL;
+  for (i = 0; i < 6; i++)
+    hash = (hash ^ bdaddr->b[i]) * 0x100000001b3ULL;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
+
+static int hll_get(const unsigned char* registers, int index) {
+  return index & 1 ? registers[index / 2] >> 4 : registers[index / 2] & 0x0F;
+}
+
+static void hll_set(unsigned char* registers, int index, int rank) {
+  if (index & 1)
+    registers[index / 2] = (registers[index / 2] & 0x0F) | rank << 4;
+  else
+    registers[index / 2] = (registers[index / 2] & 0xF0) | rank;
+}
+
+//  Register of the hash's top bits keeps the longest run of zeros
+static void hll_add(unsigned char* registers, unsigned long long hash) {
+  int index = hash >> (64 - HLL_PRECISION);
+  unsigned long long rest = hash << HLL_PRECISION;
+  int rank = 1;
+
+  while (rank < HLL_MAX_RANK && !(rest & 1ULL << 63)) {
+    rest <<= 1;
+    rank++;
+  }
+  if (rank > hll_get(registers, index))
+    hll_set(registers, index, rank);
+}
+
+double hll_estimate(const unsigned char registers[HLL_REGISTERS / 2]) {
+  double alpha = 0.7213 / (1 + 1.079 / HLL_REGISTERS), sum = 0, estimate;
+  int i, zeros = 0, rank;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    rank = hll_get(registers, i);
+    sum += ldexp(1.0, -rank);
+    if (rank == 0)
+      zeros++;
+  }
+  estimate = alpha * HLL_REGISTERS * HLL_REGISTERS / sum;
+  //  Linear counting is closer for small numbers of devices
+  if (estimate <= 2.5 * HLL_REGISTERS && zeros > 0)
+    estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeros);
+  return estimate;
+}
+
+//  Bit k of the filter by double hashing the two halves of the hash
+static int return_filter_bit(unsigned long long hash, int k) {
+  unsigned int h1 = (unsigned int)hash, h2 = (unsigned int)(hash >> 32) | 1;
+
+  return (int)((h1 + (unsigned long long)k * h2) % return_filter_bits);
+}
+
+//  Expected false positive rate (%) of the return filter from the bits
+//  set in both generations, called with analytics_lock held
+static double return_filter_fp_rate() {
+  double p0 = pow((double)return_filter_set[0] / return_filter_bits,
+                  return_filter_hashes);
+  double p1 = pow((double)return_filter_set[1] / return_filter_bits,
+                  return_filter_hashes);
+
+  return (1 - (1 - p0) * (1 - p1)) * 100;
+}
+
+//  Whether the device was seen before, then mark it seen
+static int return_filter_check(unsigned long long hash) {
+  int k, bit, seen[2] = {1, 1};
+
+  for (k = 0; k < return_filter_hashes; k++) {
+    bit = return_filter_bit(hash, k);
+    if (!(return_filter[0][bit / 8] & 1 << bit % 8)) {
+      seen[0] = 0;
+      return_filter[0][bit / 8] |= 1 << bit % 8;
+      return_filter_set[0]++;
+    }
+    if (!(return_filter[1][bit / 8] & 1 << bit % 8))
+      seen[1] = 0;
+  }
+  return seen[0] || seen[1];
+}
+
+static void analytics_end_visit(PresenceVisit* visit) {
+  int i, dwell = (int)((visit->last_seen - visit->first_seen) / 1000);
+
+  for (i = 0; i < DWELL_BUCKETS - 1 && dwell >= dwell_bounds[i]; i++)
+    ;
+  dwell_histogram[i]++;
+  visit->used = 0;
+}
+
+/*********************************************************************
+ * @fn      analytics_observe
+ *
+ * @brief   Count an inquiry result in the unique devices of the window
+ *          and extend or start the visit of the device. A new visit is
+ *          returning when the device was seen in the last day, and is
+ *          left unclassified while the return filter is saturated.
+ *          When every visit is taken, the one seen longest ago ends.
+ *
+ * @param   hash - hash of the address by "@fn analytics_hash"
+ *          now - time of the result (ms)
+ *
+ * @return  none
+ */
+void analytics_observe(unsigned long long hash, long long now) {
+  PresenceVisit* visit = NULL;
+  int i, free_visit = -1, oldest = 0;
+
+  pthread_mutex_lock(&analytics_lock);
+  analytics_results++;
+  hll_add(analytics_registers, hash);
+  for (i = 0; i < ANALYTICS_DEVICES && visit == NULL; i++) {
+    if (!presence_visits[i].used) {
+      if (free_visit == -1)
+        free_visit = i;
+    } else if (presence_visits[i].hash == hash) {
+      visit = &presence_visits[i];
+    } else if (presence_visits[i].last_seen <
+               presence_visits[oldest].last_seen) {
+      oldest = i;
+    }
+  }
+  if (visit == NULL) {
+    visit = &presence_visits[free_visit != -1 ? free_visit : oldest];
+    if (visit->used)
+      analytics_end_visit(visit);
+    visit->used = 1;
+    visit->hash = hash;
+    visit->first_seen = now;
+    if (return_filter_fp_rate() >= RETURN_FILTER_SATURATED) {
+      return_filter_check(hash);
+      visits_unclassified++;
+    } else if (return_filter_check(hash)) {
+      visits_returning++;
+    } else {
+      visits_new++;
+    }
+  }
+  visit->last_seen = now;
+  pthread_mutex_unlock(&analytics_lock);
+}
+
+static void put_be(unsigned char* out, unsigned long value, int bytes) {
+  while (bytes-- > 0) {
+    out[bytes] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+static unsigned long get_be(const unsigned char* in, int bytes) {
+  unsigned long value = 0;
+
+  while (bytes-- > 0)
+    value = value << 8 | *in++;
+  return value;
+}
+
+//  Called with analytics_lock held
+void analytics_encode(struct AnalyticsSketch* sketch, long long now) {
+  int i;
+
+  memset(sketch, 0, sizeof(*sketch));
+  sketch->version = ANALYTICS_VERSION;
+  sketch->precision = HLL_PRECISION;
+  put_be(sketch->window_end, now / 1000, 4);
+  put_be(sketch->window_len, (now - analytics_window_start) / 1000, 2);
+  put_be(sketch->visits_new, visits_new < 0xFFFF ? visits_new : 0xFFFF, 2);
+  put_be(sketch->visits_returning,
+         visits_returning < 0xFFFF ? visits_returning : 0xFFFF, 2);
+  for (i = 0; i < DWELL_BUCKETS; i++)
+    put_be(sketch->dwell[i],
+           dwell_histogram[i] < 0xFFFF ? dwell_histogram[i] : 0xFFFF, 2);
+  memcpy(sketch->registers, analytics_registers, sizeof(sketch->registers));
+}
+
+/*********************************************************************
+ * @fn      analytics_merge
+ *
+ * @brief   Merge the sketch of another beacon or window: each register
+ *          keeps the larger rank, so the unique devices of the union
+ *          are estimated without double counting, and the counts add
+ *          up. The window grows to cover both.
+ *
+ * @param   into - sketch merged into
+ *          from - sketch merged
+ *
+ * @return  none
+ */
+void analytics_merge(struct AnalyticsSketch* into,
+                     const struct AnalyticsSketch* from) {
+  unsigned long end = get_be(into->window_end, 4);
+  unsigned long start = end - get_be(into->window_len, 2);
+  unsigned long from_end = get_be(from->window_end, 4);
+  unsigned long from_start = from_end - get_be(from->window_len, 2);
+  unsigned long sum;
+  int i, rank;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    rank = hll_get(from->registers, i);
+    if (rank > hll_get(into->registers, i))
+      hll_set(into->registers, i, rank);
+  }
+  sum = get_be(into->visits_new, 2) + get_be(from->visits_new, 2);
+  put_be(into->visits_new, sum < 0xFFFF ? sum : 0xFFFF, 2);
+  sum = get_be(into->visits_returning, 2) + get_be(from->visits_returning, 2);
+  put_be(into->visits_returning, sum < 0xFFFF ? sum : 0xFFFF, 2);
+  for (i = 0; i < DWELL_BUCKETS; i++) {
+    sum = get_be(into->dwell[i], 2) + get_be(from->dwell[i], 2);
+    put_be(into->dwell[i], sum < 0xFFFF ? sum : 0xFFFF, 2);
+  }
+  if (from_start < start)
+    start = from_start;
+  if (from_end > end)
+    end = from_end;
+  put_be(into->window_end, end, 4);
+  put_be(into->window_len, end - start < 0xFFFF ? end - start : 0xFFFF, 2);
+}
+
+/*********************************************************************
+ * @fn      analytics_tick
+ *
+ * @brief   End the visits of devices gone for ANALYTICS_ABSENCE, and at
+ *          the end of each window send its sketch to the gateway and
+ *          start the next. Called by the Timeout cleaner.
+ *
+ * @param   now - current time (ms)
+ *
+ * @return  none
+ */
+void analytics_tick(long long now) {
+  struct AnalyticsSketch sketch;
+  int i, send = 0;
+
+  if (analytics_window <= 0)
+    return;
+  pthread_mutex_lock(&analytics_lock);
+  for (i = 0; i < ANALYTICS_DEVICES; i++)
+    if (presence_visits[i].used &&
+        now - presence_visits[i].last_seen > ANALYTICS_ABSENCE)
+      analytics_end_visit(&presence_visits[i]);
+  if (now - return_filter_rotated >= ANALYTICS_HISTORY) {
+    memcpy(return_filter[1], return_filter[0], return_filter_bits / 8);
+    memset(return_filter[0], 0, return_filter_bits / 8);
+    return_filter_set[1] = return_filter_set[0];
+    return_filter_set[0] = 0;
+    return_filter_rotated = now;
+  }
+  if (now - analytics_window_start >= analytics_window) {
+    analytics_encode(&sketch, now);
+    for (i = 0; i < HLL_REGISTERS; i++)
+      if (hll_get(analytics_registers, i) >
+          hll_get(analytics_total_registers, i))
+        hll_set(analytics_total_registers, i,
+                hll_get(analytics_registers, i));
+    memset(analytics_registers, 0, sizeof(analytics_registers));
+    memset(dwell_histogram, 0, sizeof(dwell_histogram));
+    visits_new = 0;
+    visits_returning = 0;
+    visits_unclassified = 0;
+    analytics_window_start = now;
+    sketches_sent++;
+    send = 1;
+  }
+  pthread_mutex_unlock(&analytics_lock);
+  if (send)
+    zigbee_send(CMD_ANALYTICS, (unsigned char*)&sketch, sizeof(sketch));
+}
+
+/*********************************************************************
+ * @fn      analytics_report
+ *
+ * @brief   Print the unique devices, visits and dwell times of the
+ *          current window, the unique devices since start and the fill
+ *          of the return filter. New and returning visits aren't shown
+ *          while the filter is saturated.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void analytics_report() {
+  unsigned char total[HLL_REGISTERS / 2];
+  double fp_rate;
+  int i;
+
+  if (analytics_window <= 0)
+    return;
+  pthread_mutex_lock(&analytics_lock);
+  for (i = 0; i < HLL_REGISTERS; i++)
+    hll_set(total, i,
+            hll_get(analytics_registers, i) >
+                    hll_get(analytics_total_registers, i)
+                ? hll_get(analytics_registers, i)
+                : hll_get(analytics_total_registers, i));
+  printf("Analytics report (%lld s window, %zu byte sketches)\n",
+         analytics_window / 1000, sizeof(struct AnalyticsSketch));
+  fp_rate = return_filter_fp_rate();
+  if (fp_rate < RETURN_FILTER_SATURATED)
+    printf("  window:  ~%.0f unique devices in %lld s, %u new and %u "
+           "returning visits, %u unclassified\n",
+           hll_estimate(analytics_registers),
+           (getSystemTime() - analytics_window_start) / 1000, visits_new,
+           visits_returning, visits_unclassified);
+  else
+    printf("  window:  ~%.0f unique devices in %lld s, return filter "
+           "saturated, %u visits unclassified\n",
+           hll_estimate(analytics_registers),
+           (getSystemTime() - analytics_window_start) / 1000,
+           visits_unclassified);
+  printf("  returns: %d bit filter, %d hashes, %.1f%% and %.1f%% full, "
+         "~%.2f%% false positives\n",
+         return_filter_bits, return_filter_hashes,
+         return_filter_set[0] * 100.0 / return_filter_bits,
+         return_filter_set[1] * 100.0 / return_filter_bits, fp_rate);
+  printf("  total:   ~%.0f unique devices, %lld results, %lld sketches "
+         "sent\n",
+         hll_estimate(total), analytics_results, sketches_sent);
+  printf("  dwell:  ");
+  for (i = 0; i < DWELL_BUCKETS; i++)
+    if (dwell_bounds[i] == INT_MAX)
+      printf(" >=%ds %u", dwell_bounds[i - 1], dwell_histogram[i]);
+    else
+      printf(" <%ds %u", dwell_bounds[i], dwell_histogram[i]);
+  printf("\n");
+  pthread_mutex_unlock(&analytics_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      suppress_init
+ *
+ * @brief   Size the pushed-device filters for the target false
+ *          positive rate at the expected pushes per generation,
+ *          m = -n ln(p) / ln(2)^2 bits and k = m / n ln(2) hashes.
+ *          Every LBeacon of a site needs the same Suppress_FP_Rate,
+ *          Suppress_Capacity and Analytics_Salt to share filters.
+ *
+ * @param   cfg - config read from the config file
+ *
+ * @return  none
+ */
+void suppress_init(struct config* cfg) {
+  double bits;
+
+  suppress_time =
+      get_config_int(cfg->suppress_time, cfg->suppress_time_len, 0) * 1000LL;
+  if (suppress_time > 0 && !analytics_salted) {
+    fprintf(stderr, "No Analytics_Salt configured, push suppression "
+                    "disabled\n");
+    suppress_time = 0;
+  }
+  if (cfg->suppress_fp_rate_len > 0 && atof(cfg->suppress_fp_rate) > 0)
+    suppress_fp_rate = atof(cfg->suppress_fp_rate);
+  suppress_capacity =
+      get_config_int(cfg->suppress_capacity, cfg->suppress_capacity_len,
+                     DEFAULT_SUPPRESS_CAPACITY);
+  if (suppress_capacity <= 0)
+    suppress_capacity = DEFAULT_SUPPRESS_CAPACITY;
+
+  bits = -suppress_capacity * log(suppress_fp_rate / 100) / (M_LN2 * M_LN2);
+  suppress_bits = bits < 64 ? 64 : bits > SUPPRESS_MAX_BITS
+                                        ? SUPPRESS_MAX_BITS
+                                        : ((int)bits + 7) / 8 * 8;
+  suppress_hashes =
+      (int)((double)suppress_bits / suppress_capacity * M_LN2 + 0.5);
+  if (suppress_hashes < 1)
+    suppress_hashes = 1;
+  if (suppress_hashes > 16)
+    suppress_hashes = 16;
+  suppress_rotated = getSystemTime();
+  suppress_published = suppress_rotated;
+}
+
+//  Bit i of the filter by double hashing the two halves of the hash
+static int suppress_bit(unsigned long long hash, int i) {
+  unsigned int h1 = (unsigned int)hash, h2 = (unsigned int)(hash >> 32) | 1;
+
+  return (int)((h1 + (unsigned long long)i * h2) % suppress_bits);
+}
+
+static void bloom_add(unsigned char* filter, unsigned long long hash) {
+  int i, bit;
+
+  for (i = 0; i < suppress_hashes; i++) {
+    bit = suppress_bit(hash, i);
+    filter[bit / 8] |= 1 << bit % 8;
+  }
+}
+
+static int bloom_test(const unsigned char* filter, unsigned long long hash) {
+  int i, bit;
+
+  for (i = 0; i < suppress_hashes; i++) {
+    bit = suppress_bit(hash, i);
+    if (!(filter[bit / 8] & 1 << bit % 8))
+      return 0;
+  }
+  return 1;
+}
+
+static unsigned long long suppress_hash(char addr[]) {
+  bdaddr_t bdaddr;
+
+  str2ba(addr, &bdaddr);
+  return analytics_hash(&bdaddr);
+}
+
+//  Expected false positive rate of a filter from the bits set
+static double bloom_fp_rate(const unsigned char* filter) {
+  int i, set = 0;
+
+  for (i = 0; i < suppress_bits / 8; i++)
+    set += __builtin_popcount(filter[i]);
+  return pow((double)set / suppress_bits, suppress_hashes);
+}
+
+int suppress_check(char addr[]) {
+  unsigned long long hash;
+  int found;
+
+  if (suppress_time <= 0)
+    return 0;
+  hash = suppress_hash(addr);
+  pthread_mutex_lock(&suppress_lock);
+  found = bloom_test(neighbour_index[0], hash) ||
+          bloom_test(neighbour_index[1], hash);
+  if (found)
+    suppressed_pushes++;
+  pthread_mutex_unlock(&suppress_lock);
+  return found;
+}
+
+//  Take the pending pushes as a delta update, called with
+//  suppress_lock held
+static int suppress_take_delta(unsigned char* delta, long long now) {
+  int i, j, len;
+
+  delta[0] = SUPPRESS_VERSION;
+  delta[1] = suppress_pending_count;
+  for (i = 0; i < suppress_pending_count; i++)
+    for (j = 0; j < 8; j++)
+      delta[2 + i * 8 + j] = suppress_pending[i] >> (56 - j * 8);
+  len = 2 + suppress_pending_count * 8;
+  suppress_pending_count = 0;
+  suppress_published = now;
+  suppress_deltas_sent++;
+  return len;
+}
+
+void suppress_pushed(char addr[]) {
+  unsigned char delta[2 + SUPPRESS_DELTA_MAX * 8];
+  unsigned long long hash;
+  int delta_len = 0;
+
+  if (suppress_time <= 0)
+    return;
+  hash = suppress_hash(addr);
+  pthread_mutex_lock(&suppress_lock);
+  bloom_add(local_filter[0], hash);
+  suppress_pending[suppress_pending_count++] = hash;
+  //  A full delta goes out now rather than at the next tick, so no
+  //  push is left out of it
+  if (suppress_pending_count == SUPPRESS_DELTA_MAX)
+    delta_len = suppress_take_delta(delta, getSystemTime());
+  pthread_mutex_unlock(&suppress_lock);
+  if (delta_len > 0)
+    zigbee_send(CMD_SUPPRESS_DELTA, delta, delta_len);
+}
+
+/*********************************************************************
+ * @fn      suppress_merge_delta
+ *
+ * @brief   Add the devices of a neighbour's delta update to the index.
+ *          A delta is the version, the number of devices and the
+ *          8 byte hash of each, so it doesn't depend on the filter
+ *          size of the sender.
+ *
+ * @param   data - delta update
+ *          len - length of data
+ *
+ * @return  none
+ */
+void suppress_merge_delta(unsigned char* data, int len) {
+  unsigned long long hash;
+  int i, j, count;
+
+  if (suppress_time <= 0 || len < 2 || data[0] != SUPPRESS_VERSION)
+    return;
+  count = data[1];
+  if (len < 2 + count * 8)
+    return;
+  pthread_mutex_lock(&suppress_lock);
+  for (i = 0; i < count; i++) {
+    hash = 0;
+    for (j = 0; j < 8; j++)
+      hash = hash << 8 | data[2 + i * 8 + j];
+    bloom_add(neighbour_index[0], hash);
   }
-  close(sock);
-  pthread_exit(0);
+  suppress_deltas_received++;
+  pthread_mutex_unlock(&suppress_lock);
 }
 
 /*********************************************************************
- * @fn      timeout_cleaner
+ * @fn      suppress_merge_filter
  *
- * @brief   Thread of Timeout cleaner.
- *          When Bluetooth was pushed by push function
- *          it address will store in used list then
- *          wait for timeout to be remove from list.
+ * @brief   OR a neighbour's filter snapshot into the index. A snapshot
+ *          is the version, the hashes, the bits (2 bytes), the
+ *          generation (0 current, 1 older) and the filter, and is
+ *          dropped unless its size matches this LBeacon's.
  *
- * @param   none
+ * @param   data - filter snapshot
+ *          len - length of data
  *
  * @return  none
  */
-void* timeout_cleaner(void) {
-  while (1) {
-    int i = 0, j;
+void suppress_merge_filter(unsigned char* data, int len) {
+  int i, generation;
 
-    for (i = 0; i < MAX_OF_DEVICE; i++)
-      if (getSystemTime() - UsedDeviceQueue.DeviceAppearTime[i] > Timeout &&
-          UsedDeviceQueue.DeviceUsed[i] == 1) {
-        printf("Cleanertime: %lld ms\n",
-               getSystemTime() - UsedDeviceQueue.DeviceAppearTime[i]);
-        for (j = 0; j < 18; j++) {
-          UsedDeviceQueue.DeviceAppearAddr[i][j] = 0;
-        }
-        UsedDeviceQueue.DeviceAppearTime[i] = 0;
-        UsedDeviceQueue.DeviceUsed[i] = 0;
-      }
+  if (suppress_time <= 0 || len < SUPPRESS_HEADER_SIZE ||
+      data[0] != SUPPRESS_VERSION)
+    return;
+  pthread_mutex_lock(&suppress_lock);
+  if (data[1] != suppress_hashes || (data[2] << 8 | data[3]) != suppress_bits ||
+      len < SUPPRESS_HEADER_SIZE + suppress_bits / 8) {
+    suppress_filters_mismatched++;
+  } else {
+    generation = data[4] ? 1 : 0;
+    for (i = 0; i < suppress_bits / 8; i++)
+      neighbour_index[generation][i] |= data[SUPPRESS_HEADER_SIZE + i];
+    suppress_filters_received++;
   }
+  pthread_mutex_unlock(&suppress_lock);
 }
 
 /*********************************************************************
- * @fn      get_config
+ * @fn      suppress_tick
  *
- * @brief   Read the config file and initialize parameter
+ * @brief   Send the pushes of the last SUPPRESS_PUBLISH_INTERVAL to
+ *          the gateway as a delta update, which fits in one frame.
+ *          Every suppress_time / 2 the filters drop their older
+ *          generation, and the generation just completed is sent as a
+ *          snapshot, repairing neighbours which missed a delta.
+ *          Called by the Timeout cleaner.
  *
- * @param   filename: Name of config file
+ * @param   now - current time (ms)
  *
- * @return  configstruct include filepath coordinate etc.
+ * @return  none
  */
-struct config get_config(char* filename) {
-  struct config configstruct;
-  FILE* file = fopen(filename, "r");
-
-  if (file != NULL) {
-    char line[MAXBUF];
-    int i = 0;
+void suppress_tick(long long now) {
+  unsigned char delta[2 + SUPPRESS_DELTA_MAX * 8];
+  unsigned char snapshot[PACKET_MAX_MESSAGE];
+  int delta_len = 0, snapshot_len = 0;
 
-    while (fgets(line, sizeof(line), file) != NULL) {
-      char* cfline;
-      cfline = strstr((char*)line, DELIM);
-      cfline = cfline + strlen(DELIM);
+  if (suppress_time <= 0)
+    return;
+  pthread_mutex_lock(&suppress_lock);
+  if (suppress_pending_count > 0 &&
+      now - suppress_published >= SUPPRESS_PUBLISH_INTERVAL)
+    delta_len = suppress_take_delta(delta, now);
+  if (now - suppress_rotated >= suppress_time / 2) {
+    snapshot[0] = SUPPRESS_VERSION;
+    snapshot[1] = suppress_hashes;
+    snapshot[2] = suppress_bits >> 8;
+    snapshot[3] = suppress_bits & 0xFF;
+    snapshot[4] = 1;
+    memcpy(snapshot + SUPPRESS_HEADER_SIZE, local_filter[0],
+           suppress_bits / 8);
+    snapshot_len = SUPPRESS_HEADER_SIZE + suppress_bits / 8;
+    memcpy(local_filter[1], local_filter[0], sizeof(local_filter[1]));
+    memset(local_filter[0], 0, sizeof(local_filter[0]));
+    memcpy(neighbour_index[1], neighbour_index[0], sizeof(neighbour_index[1]));
+    memset(neighbour_index[0], 0, sizeof(neighbour_index[0]));
+    suppress_rotated = now;
+    suppress_filters_sent++;
+  }
+  pthread_mutex_unlock(&suppress_lock);
+  if (delta_len > 0)
+    zigbee_send(CMD_SUPPRESS_DELTA, delta, delta_len);
+  if (snapshot_len > 0)
+    zigbee_send(CMD_SUPPRESS_FILTER, snapshot, snapshot_len);
+}
 
-      if (i == 0) {
-        memcpy(configstruct.filepath, cfline, strlen(cfline));
-        configstruct.filepath_len = strlen(cfline);
-        // printf("%s",configstruct.imgserver);
-      } else if (i == 1) {
-        memcpy(configstruct.filename, cfline, strlen(cfline));
-        configstruct.filename_len = strlen(cfline);
-        // printf("%s",configstruct.ccserver);
-      } else if (i == 2) {
-        memcpy(configstruct.coordinate_X, cfline, strlen(cfline));
-        configstruct.coordinate_X_len = strlen(cfline);
-        // printf("%s",configstruct.port);
-      } else if (i == 3) {
-        memcpy(configstruct.coordinate_Y, cfline, strlen(cfline));
-        configstruct.coordinate_Y_len = strlen(cfline);
-        // printf("%s",configstruct.imagename);
-      } else if (i == 4) {
-        memcpy(configstruct.level, cfline, strlen(cfline));
-        configstruct.level_len = strlen(cfline);
-        // printf("%s",configstruct.getcmd);
-      } else if (i == 5) {
-        memcpy(configstruct.RSSI_Coverage, cfline, strlen(cfline));
-        configstruct.RSSI_Coverage_len = strlen(cfline);
-        // printf("%s",configstruct.coordinate_X);
-      }
-      i++;
-    }  // End while
-    fclose(file);
-  }  // End if file
+/*********************************************************************
+ * @fn      suppress_report
+ *
+ * @brief   Print the filter size, the target false positive rate and
+ *          the rate expected from the bits set in the index, and the
+ *          pushes suppressed and updates exchanged.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+void suppress_report() {
+  double fp;
 
-  return configstruct;
+  if (suppress_time <= 0)
+    return;
+  pthread_mutex_lock(&suppress_lock);
+  fp = 1 - (1 - bloom_fp_rate(neighbour_index[0])) *
+               (1 - bloom_fp_rate(neighbour_index[1]));
+  printf("Push suppression report (%lld s)\n", suppress_time / 1000);
+  printf("  filter:     %d bits, %d hashes, %d pushes per generation\n",
+         suppress_bits, suppress_hashes, suppress_capacity);
+  printf("  false pos.: %.3f%% target, %.3f%% in the neighbour index\n",
+         suppress_fp_rate, fp * 100);
+  printf("  suppressed: %lld devices\n", suppressed_pushes);
+  printf("  sent:       %lld deltas, %lld snapshots\n", suppress_deltas_sent,
+         suppress_filters_sent);
+  printf("  received:   %lld deltas, %lld snapshots, %lld of another size\n",
+         suppress_deltas_received, suppress_filters_received,
+         suppress_filters_mismatched);
+  pthread_mutex_unlock(&suppress_lock);
+  fflush(NULL);
 }
 
 /*********************************************************************
- * @fn      wait_gateway_bindCB
+ * @fn      dedup_save
  *
- * @brief   Callback of @fn wait_gateway_bind.
- *          when Lbeacon start ZigBee will wait for
- *          Gateway to bind with.
+ * @brief   Save the recently pushed devices with the time of their
+ *          push, so a restart doesn't push them again. The file is
+ *          written aside and renamed, a crash never leaves half of it.
  *
- * @param   xbee: Name of config file
- *          con: Get Lbeacon connection info
- *          pkt: received data and address from gateway
- *          data:
+ * @param   none
  *
- * @return  none
+ * @return  0: saved
+ *          -1: the file can't be written
  */
-void wait_gateway_bindCB(struct xbee* xbee,
-                         struct xbee_con* con,
-                         struct xbee_pkt** pkt,
-                         void** data) {
-  if ((*pkt)->dataLen > 0) {
-    printf("rx: [%s]\n", (*pkt)->data);
-    parse_packet((*pkt)->data, (*pkt)->address);
+int dedup_save() {
+  char path[PATH_MAX];
+  FILE* file;
+  int i;
+
+  if (dedup_state_file == NULL)
+    return 0;
+  snprintf(path, sizeof(path), "%s.tmp", dedup_state_file);
+  file = fopen(path, "w");
+  if (file == NULL) {
+    perror("Can't save pushed devices");
+    return -1;
   }
+  pthread_mutex_lock(&scan_lock);
+  dedup_dirty = 0;
+  for (i = 0; i < MAX_OF_DEVICE; i++)
+    if (UsedDeviceQueue.DeviceUsed[i] == 1)
+      fprintf(file, "%.17s %lld\n", UsedDeviceQueue.DeviceAppearAddr[i],
+              UsedDeviceQueue.DeviceAppearTime[i]);
+  pthread_mutex_unlock(&scan_lock);
+  if (fclose(file) != 0 || rename(path, dedup_state_file) != 0) {
+    perror("Can't save pushed devices");
+    return -1;
+  }
+  return 0;
 }
 
 /*********************************************************************
- * @fn      wait_gateway_bind
+ * @fn      dedup_restore
  *
- * @brief   Wait the binding request from gateway.
+ * @brief   Restore the recently pushed devices saved by
+ *          "@fn dedup_save". Devices pushed longer than Timeout ago
+ *          are left out.
  *
  * @param   none
  *
- * @return  none
+ * @return  0: restored, or nothing was saved
+ *          -1: the file can't be read
  */
-int wait_gateway_bind() {
-  int n;
-  int len;
-  struct xbee_conAddress address;
-  unsigned char buffer[16];
-  xbee_err ret;
-  memset(&address, 0, sizeof(address));
-  address.addr64_enabled = 1;
-  address.addr64[0] = 0x00;
-  address.addr64[1] = 0x00;
-  address.addr64[2] = 0x00;
-  address.addr64[3] = 0x00;
-  address.addr64[4] = 0x00;
-  address.addr64[5] = 0x00;
-  address.addr64[6] = 0xFF;
-  address.addr64[7] = 0xFF;
-  if ((ret = xbee_conNew(xbee, &con, "Data", &address)) != XBEE_ENONE) {
-    xbee_log(xbee, -1, "xbee_conNew() returned: %d (%s)", ret,
-             xbee_errorToStr(ret));
-    return ret;
+int dedup_restore() {
+  char addr[18];
+  long long time, now = getSystemTime();
+  int i = 0, restored = 0;
+  FILE* file;
+
+  if (dedup_state_file == NULL)
+    return 0;
+  file = fopen(dedup_state_file, "r");
+  if (file == NULL)
+    return errno == ENOENT ? 0 : -1;
+  pthread_mutex_lock(&scan_lock);
+  while (i < MAX_OF_DEVICE && fscanf(file, "%17s %lld", addr, &time) == 2) {
+    if (now - time > Timeout || time > now)
+      continue;
+    memcpy(UsedDeviceQueue.DeviceAppearAddr[i], addr, sizeof(addr));
+    UsedDeviceQueue.DeviceAppearTime[i] = time;
+    UsedDeviceQueue.DeviceUsed[i] = 1;
+    i++;
+    restored++;
   }
+  pthread_mutex_unlock(&scan_lock);
+  fclose(file);
+  printf("Restored %d pushed devices\n", restored);
+  return 0;
+}
 
-  if ((ret = xbee_conCallbackSet(con, wait_gateway_bindCB, NULL)) !=
-      XBEE_ENONE) {
-    xbee_log(xbee, -1, "xbee_conCallbackSet() returned: %d", ret);
-    return ret;
+//  Startup step: advertise the coordinates over BLE
+static int startup_advertise() {
+  return adapter_advertise(adapter_ready(ADAPTER_ADVERTISE, 0));
+}
+
+//  Startup step: check that at least one Scan dongle opens
+static int startup_scan() {
+  int i, dev_id, sock, ready = 0;
+
+  for (i = 0; i < scan_adapter_count; i++) {
+    dev_id = adapter_ready(ADAPTER_SCAN, i);
+    sock = dev_id >= 0 ? hci_open_dev(dev_id) : -1;
+    if (sock < 0) {
+      fprintf(stderr, "Scan dongle hci%d isn't ready\n",
+              adapter_dev_id(ADAPTER_SCAN, i));
+      continue;
+    }
+    close(sock);
+    ready++;
   }
+  return ready > 0 ? 0 : -1;
+}
 
-  /* getting an ACK for a broadcast message is kinda pointless... */
-  xbee_conSettings(con, NULL, &settings);
-  settings.disableAck = 1;
-  xbee_conSettings(con, &settings, NULL);
+//  Startup step: check that both push dongles open
+static int startup_push() {
+  int i, sock, dev_id, ret = 0;
+
+  for (i = 0; i < PUSHDONGLES; i++) {
+    dev_id = adapter_ready(ADAPTER_PUSH, i);
+    sock = dev_id >= 0 ? hci_open_dev(dev_id) : -1;
+    if (sock < 0) {
+      fprintf(stderr, "Push dongle %d (hci%d) isn't ready\n", i, dev_id);
+      ret = -1;
+      continue;
+    }
+    close(sock);
+  }
+  return ret;
+}
+
+//  Startup step: open the XBee and listen for the gateway
+static int startup_zigbee() {
+  static pthread_t monitor;
+
+  if (zigbee_init() != 0 || wait_gateway_bind() != 0)
+    return -1;
+  //  Heartbeat and failover to the next gateway of the list
+  if (heartbeat_interval > 0)
+    pthread_create(&monitor, NULL, gateway_monitor, NULL);
+  return 0;
+}
+
+//  Startup step: check the objects of the push profile, preloaded in
+//  budget mode
+static int startup_content() {
+  int i;
+
+  for (i = 0; i < push_object_count; i++) {
+    if (memory_budget_mode ? content_preload(&push_objects[i]) < 0
+                           : access(push_objects[i].path, R_OK) < 0) {
+      fprintf(stderr, "Can't read push object %s\n", push_objects[i].path);
+      return -1;
+    }
+  }
   return 0;
 }
 
+StartupStep startup_steps[STARTUP_STEPS] = {
+    [STEP_ADVERTISE] = {"advertise", startup_advertise, 5000, 1},
+    [STEP_SCAN] = {"scan", startup_scan, 3000, 1},
+    [STEP_PUSH] = {"push", startup_push, 3000, 1},
+    [STEP_ZIGBEE] = {"zigbee", startup_zigbee, 10000, 1},
+    [STEP_CONTENT] = {"content", startup_content, 3000, 0},
+    [STEP_DEDUP] = {"dedup", dedup_restore, 3000, 0},
+};
+
+static void* startup_step_thread(void* ptr) {
+  StartupStep* step = (StartupStep*)ptr;
+  int ret = step->run();
+
+  pthread_mutex_lock(&startup_lock);
+  step->end = getSystemTime();
+  if (step->state == STEP_RUNNING) {
+    step->state = ret == 0 ? STEP_DONE : STEP_FAILED;
+  } else {
+    step->late = 1;
+    printf("Startup: %s finished after %lld ms, past its timeout\n",
+           step->name, step->end - step->start);
+  }
+  pthread_cond_broadcast(&startup_cond);
+  pthread_mutex_unlock(&startup_lock);
+  return NULL;
+}
+
 /*********************************************************************
- * @fn      rcvCB
+ * @fn      startup_begin
  *
- * @brief   receive data from gateway
+ * @brief   Start every startup step in its own detached thread, so a
+ *          step which hangs, e.g. a missing XBee, holds up nothing
+ *          else. The load test skips the steps needing hardware.
  *
- * @param   xbee: Name of config file
- *          con: Get Lbeacon connection info
- *          pkt: received data and address from gateway
- *          data:
+ * @param   load_test - the load generator replaces the hardware
  *
  * @return  none
  */
-void rcvCB(struct xbee* xbee,
-           struct xbee_con* con,
-           struct xbee_pkt** pkt,
-           void** data) {
-  if ((*pkt)->dataLen > 0) {
-    printf("rx: [%s]\n", (*pkt)->data);
-    parse_packet((*pkt)->data, (*pkt)->address);
+void startup_begin(int load_test) {
+  StartupStep* step;
+  int i;
+
+  pthread_mutex_lock(&startup_lock);
+  for (i = 0; i < STARTUP_STEPS; i++) {
+    step = &startup_steps[i];
+    step->start = getSystemTime();
+    if (load_test && step->hardware) {
+      step->state = STEP_SKIPPED;
+      step->end = step->start;
+      continue;
+    }
+    step->state = STEP_RUNNING;
+    if (pthread_create(&step->t, NULL, startup_step_thread, step) != 0) {
+      perror("Can't start startup step");
+      step->state = STEP_FAILED;
+      step->end = step->start;
+      continue;
+    }
+    pthread_detach(step->t);
   }
+  pthread_mutex_unlock(&startup_lock);
 }
 
 /*********************************************************************
- * @fn      bind_gateway
+ * @fn      startup_wait
  *
- * @brief   When "@fn wait_gateway_bind" got request from gateway
- *          it will send the address via "@fn parse_packet"
- *          to this function and then bind with gateway.
+ * @brief   Wait until each of the given startup steps ends. A step
+ *          running past its timeout is given up and LBeacon carries on
+ *          without it; its thread may still finish later.
  *
- * @param   address: Gateway's ZigBee Mac address
+ * @param   mask - bit (1 << STEP_*) of each step to wait for
  *
- * @return  error event
+ * @return  none
  */
-int bind_gateway(struct xbee_conAddress address) {
-  void* d;
-  xbee_err ret;
-  address.addr64_enabled = 1;
-  if ((ret = xbee_conNew(xbee, &g_con, "Data", &address)) != XBEE_ENONE) {
-    xbee_log(xbee, -1, "xbee_conNew() returned: %d (%s)", ret,
-             xbee_errorToStr(ret));
-    return ret;
-  }
-
-  if ((ret = xbee_conDataSet(g_con, xbee, NULL)) != XBEE_ENONE) {
-    xbee_log(xbee, -1, "xbee_conDataSet() returned: %d", ret);
-    return ret;
-  }
+void startup_wait(int mask) {
+  StartupStep* step;
+  struct timespec deadline;
+  long long now, next;
+  int i;
 
-  if ((ret = xbee_conCallbackSet(g_con, rcvCB, NULL)) != XBEE_ENONE) {
-    xbee_log(xbee, -1, "xbee_conCallbackSet() returned: %d", ret);
-    return ret;
+  pthread_mutex_lock(&startup_lock);
+  while (1) {
+    now = getSystemTime();
+    next = 0;
+    for (i = 0; i < STARTUP_STEPS; i++) {
+      step = &startup_steps[i];
+      if (!(mask & 1 << i) || step->state != STEP_RUNNING)
+        continue;
+      if (now - step->start >= step->timeout) {
+        step->state = STEP_TIMED_OUT;
+        step->end = now;
+        fprintf(stderr, "Startup: %s timed out after %d ms\n", step->name,
+                step->timeout);
+      } else if (next == 0 || step->start + step->timeout < next) {
+        next = step->start + step->timeout;
+      }
+    }
+    if (next == 0)
+      break;
+    //  getSystemTime is the realtime clock used by the condition
+    deadline.tv_sec = next / 1000;
+    deadline.tv_nsec = next % 1000 * 1000000;
+    pthread_cond_timedwait(&startup_cond, &startup_lock, &deadline);
   }
-
-  return 0;
+  pthread_mutex_unlock(&startup_lock);
 }
 
 /*********************************************************************
- * @fn      zigbee_init
+ * @fn      startup_report
  *
- * @brief   Initialize ZigBee Device.
+ * @brief   Print when each startup phase and step began and ended,
+ *          counted from the start of LBeacon, and the steps LBeacon
+ *          runs without.
  *
  * @param   none
  *
- * @return  error event
+ * @return  none
  */
-int zigbee_init() {
-  xbee_err ret;
-  if ((ret = xbee_setup(&xbee, "xbee2", "/dev/ttyUSB0", 9600)) != XBEE_ENONE) {
-    printf("ret: %d (%s)\n", ret, xbee_errorToStr(ret));
-    return ret;
+void startup_report() {
+  static const char* states[] = {"pending",   "running",   "done",
+                                 "failed",    "timed out", "skipped"};
+  StartupStep* step;
+  int i;
+
+  pthread_mutex_lock(&startup_lock);
+  printf("Startup report (config %lld ms, scanning %lld ms, done %lld ms)\n",
+         startup_config_done - startup_time,
+         startup_scanning ? startup_scanning - startup_time : -1,
+         startup_done ? startup_done - startup_time : -1);
+  for (i = 0; i < STARTUP_STEPS; i++) {
+    step = &startup_steps[i];
+    printf("  %-9s %6lld - %6lld ms  %s%s\n", step->name,
+           step->start - startup_time,
+           (step->end ? step->end : getSystemTime()) - startup_time,
+           states[step->state], step->late ? ", finished late" : "");
   }
-  return 0;
+  pthread_mutex_unlock(&startup_lock);
+  fflush(NULL);
+}
+
+/*********************************************************************
+ * @fn      sd_notify_send
+ *
+ * @brief   Send a state to the service manager over the datagram
+ *          socket named by NOTIFY_SOCKET, as sd_notify of systemd
+ *          does. Nothing is sent when LBeacon runs outside a
+ *          Type=notify service.
+ *
+ * @param   state - e.g. "READY=1\nSTATUS=Scanning"
+ *
+ * @return  0: sent, or no service manager
+ *          -1: the state can't be sent
+ */
+int sd_notify_send(const char* state) {
+  const char* path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  socklen_t len;
+  int sock, ret;
+
+  if (path == NULL || (path[0] != '/' && path[0] != '@') ||
+      strlen(path) >= sizeof(addr.sun_path))
+    return 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, strlen(path));
+  //  '@' names a socket in the abstract namespace
+  if (path[0] == '@')
+    addr.sun_path[0] = '\0';
+  len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  ret = sendto(sock, state, strlen(state), MSG_NOSIGNAL,
+               (struct sockaddr*)&addr, len);
+  close(sock);
+  return ret < 0 ? -1 : 0;
 }
 
 /*********************************************************************
@@ -664,15 +5627,52 @@ int zigbee_init() {
  */
 int main(int argc, char** argv) {
   int i = 0;
-  char cmd[100];
   char hex_c[20];
-  pthread_t Device_cleaner_id, ZigBee_id;
+  char status[100];
+  pthread_t Device_cleaner_id;
+  int load_test = 0;
+  int codec_bench = 0;
+  int trace = 0;
+  int gateway_sim = 0;
+  char* gateway_script = NULL;
+  size_t heap_reserved, heap_mapped;
+  int opt;
+  int ret;
+
+  startup_time = getSystemTime();
+  while ((opt = getopt(argc, argv, "L:BTG:")) != -1) {
+    switch (opt) {
+      case 'L':
+        //  Load test with a simulated crowd, no dongle or ZigBee needed
+        load_test = 1;
+        if (loadgen_parse(optarg) < 0)
+          exit(1);
+        break;
+      case 'B':
+        //  Benchmark of the ZigBee codec
+        codec_bench = 1;
+        break;
+      case 'T':
+        //  Trace from startup, SIGUSR2 stops and exports
+        trace = 1;
+        break;
+      case 'G':
+        //  ZigBee benchmark against a simulated gateway on a pty
+        gateway_sim = 1;
+        gateway_script = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-L load test options] [-B] [-T] "
+                "[-G gateway simulator options]\n",
+                argv[0]);
+        exit(1);
+    }
+  }
+  if (codec_bench)
+    return packet_benchmark();
 
   //*-----Initialize BLE--------
-  sprintf(cmd, "hciconfig hci0 leadv 3");
-  system(cmd);
-  sprintf(cmd, "hciconfig hci0 noscan");
-  system(cmd);
   sprintf(BLE_coordinate_cmd,
           "hcitool -i hci0 cmd 0x08 0x0008 1E 02 01 1A 1A FF 4C 00 02 15 E2 C5 "
           "6D B5 DF FB 48 D2 B0 60 D0 F5 11 11 11 11 00 00 00 00 C8 00");
@@ -680,33 +5680,112 @@ int main(int argc, char** argv) {
 
   //*-----Load config--------start
   configstruct = get_config(CONFIG_FILENAME);
-  filepath = malloc(configstruct.filepath_len + configstruct.filename_len);
+  memory_budget_init(&configstruct);
+  scan_adapters_init(&configstruct);
+  cod_filter_init(&configstruct);
+  zigbee_legacy = get_config_int(configstruct.zigbee_legacy,
+                                 configstruct.zigbee_legacy_len, 1);
+  if (configstruct.zigbee_device_len > 0 &&
+      strcspn(configstruct.zigbee_device, " \r\n") > 0) {
+    memcpy(zigbee_device, configstruct.zigbee_device, sizeof(zigbee_device));
+    zigbee_device[strcspn(zigbee_device, " \r\n")] = '\0';
+  }
+  zigbee_baud = get_config_int(configstruct.zigbee_baud,
+                               configstruct.zigbee_baud_len,
+                               DEFAULT_ZIGBEE_BAUD);
+  gwsim_model.baud = zigbee_baud;
+  gateway_init(&configstruct);
+  trace_init(&configstruct);
+  analytics_init(&configstruct);
+  suppress_init(&configstruct);
+  if (trace)
+    trace_start();
+  filepath = NULL;
+  if (memory_budget_mode)
+    filepath = arena_alloc(&content_arena, configstruct.filepath_len +
+                                               configstruct.filename_len);
+  if (filepath == NULL)
+    filepath = calloc(1, configstruct.filepath_len + configstruct.filename_len);
   memcpy(filepath, configstruct.filepath, configstruct.filepath_len - 1);
   memcpy(filepath + configstruct.filepath_len - 1, configstruct.filename,
          configstruct.filename_len - 1);
+  push_profile_init(&configstruct);
+  //  The load test takes stand-in adapters down and back
+  if (load_test)
+    adapter_backend = &sim_adapter_backend;
   coordinate_X.f = (float)atof(configstruct.coordinate_X);
   coordinate_Y.f = (float)atof(configstruct.coordinate_Y);
   printf("%s\n", hex_c);
   memcpy(BLE_coordinate_cmd + 98, hex_c, 11);
   printf("%s\n", hex_c);
   memcpy(BLE_coordinate_cmd + 110, hex_c, 11);
-  system(BLE_coordinate_cmd);
+  //  The simulated devices of a load test aren't kept across restarts
+  if (load_test)
+    dedup_state_file = NULL;
+  startup_config_done = getSystemTime();
   //*-----Load config--------end
 
-  //  Initialize the ZigeBee
-  zigbee_init();
+  //  The script is read after config, which sets the baud it emulates
+  if (gateway_sim) {
+    dedup_state_file = NULL;
+    if (gwsim_parse(gateway_script) < 0)
+      exit(1);
+    return gwsim_run();
+  }
+
+  for (i = 0; i < MAX_OF_DEVICE; i++)
+    UsedDeviceQueue.DeviceUsed[i] = 0;
+
+  //  Adapters are bound to their roles before anything uses them
+  adapters_init(&configstruct);
 
-  //  Implement a callback function to wait for gateway bind request
-  wait_gateway_bind();
+  //  Advertising, the dongles, ZigBee, the push file and the pushed
+  //  devices come up at the same time
+  startup_begin(load_test);
+
+  //  Scanning starts as soon as its dongles and push file are ready,
+  //  the others may still be starting or run degraded
+  startup_wait(SCAN_NEEDS);
 
   //          Device Cleaner
   pthread_create(&Device_cleaner_id, NULL, (void*)timeout_cleaner, NULL);
 
-  for (i = 0; i < MAX_OF_DEVICE; i++)
-    UsedDeviceQueue.DeviceUsed[i] = 0;
-  while (1) {
-    scanner_start();
+  //  Status report on SIGUSR1, tracing toggled by SIGUSR2
+  signal(SIGUSR1, report_signal_handler);
+  signal(SIGUSR2, trace_signal_handler);
+  heap_info(&heap_in_use_at_start, &heap_reserved, &heap_mapped);
+  if (memory_budget_mode)
+    memory_report();
+
+  //  One reader thread for each Scan dongle
+  if (!load_test)
+    for (i = 0; i < scan_adapter_count; i++)
+      pthread_create(&scan_adapters[i].t, NULL, scanner_thread,
+                     &scan_adapters[i]);
+  startup_scanning = getSystemTime();
+  sd_notify_send("READY=1\nSTATUS=Scanning");
+
+  startup_wait((1 << STARTUP_STEPS) - 1);
+  startup_done = getSystemTime();
+  strcpy(status, "STATUS=Scanning");
+  for (i = 0; i < STARTUP_STEPS; i++)
+    if (startup_steps[i].state != STEP_DONE &&
+        startup_steps[i].state != STEP_SKIPPED) {
+      strcat(status, strchr(status, ',') ? " " : ", degraded: ");
+      strcat(status, startup_steps[i].name);
+    }
+  sd_notify_send(status);
+  startup_report();
+
+  if (load_test) {
+    ret = loadgen_run();
+    if (trace_enabled)
+      trace_stop();
+    return ret;
   }
 
+  for (i = 0; i < scan_adapter_count; i++)
+    pthread_join(scan_adapters[i].t, NULL);
+
   return 0;
 }
\ No newline at end of file
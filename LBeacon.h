@@ -36,6 +36,8 @@
   * INCLUDES
   */
 
+//  posix_openpt and the rest of the pty calls of the gateway simulator
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -45,6 +47,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/timeb.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <pthread.h>
@@ -61,6 +64,14 @@
 #include <xbee.h>
 #include <limits.h>
 #include <ctype.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <fcntl.h>
 
 /*********************************************************************
   * CONTANTS
@@ -78,14 +89,11 @@
 //  Maximum value of each Push dongle can handle how many users
 #define NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE 9
 
-//  The number of users device responsible for each Push dongle
-#define BLOCKOFDONGLE 5
-
 //  Mark the thread that has finished working
 #define IDLE -1
 
 //  Maximum character of each line of config file
-#define MAXBUF 64
+#define MAXBUF 160
 
 //  Read the parameter after "=" from config file
 #define DELIM "="
@@ -96,12 +104,298 @@
 //  Device ID of the Scan dongle
 #define SCAN_DONGLE 1
 
+//  Maximum number of the Scan dongles scanning at the same time
+#define MAX_SCAN_DONGLES 4
+
+//  Size of the table merging the results of all Scan dongles
+#define MAX_SCANNED_DEVICE 256
+
+//  Default time a merged scan result is kept (ms)
+#define DEFAULT_MERGE_WINDOW 10000
+
+//  Inquiry length of the fixed schedule, 0x30 * 1.28 s (about 61 s)
+#define INQUIRY_LENGTH 0x30
+
+//  Default shortest inquiry of the adaptive schedule, 4 * 1.28 s
+#define DEFAULT_INQUIRY_MIN_LENGTH 4
+
+//  Default longest gap between two inquiries (ms)
+#define DEFAULT_INQUIRY_MAX_GAP 10000
+
+//  Push slots in use from which inquiry backs off, in percent
+#define INQUIRY_BACK_OFF_PRESSURE 75
+
+//  Decisions of the adaptive inquiry schedule
+#define INQUIRY_KEEP 0
+#define INQUIRY_LENGTHEN 1
+#define INQUIRY_SHORTEN 2
+#define INQUIRY_BACK_OFF 3
+#define INQUIRY_DECISIONS 4
+
 //  Device ID of the Push dongle
 #define PUSH_DONGLE_A 2
 
 //  Device ID of the secondary Push dongle
 #define PUSH_DONGLE_B 3
 
+//  Device ID of the adapter advertising the coordinates over BLE
+#define ADVERTISE_DONGLE 0
+
+//  Roles of the Bluetooth adapters
+#define ADAPTER_SCAN 0
+#define ADAPTER_PUSH 1
+#define ADAPTER_ADVERTISE 2
+
+//  Adapters with a role: the Scan dongles, Push dongles and advertiser
+#define MAX_ADAPTER_ROLES (MAX_SCAN_DONGLES + PUSHDONGLES + 1)
+
+//  Default time a simulated adapter outage of the load test lasts (ms)
+#define DEFAULT_OUTAGE_LENGTH 3000
+
+//  Number of the push slots (one push thread per slot)
+#define PUSH_SLOTS (PUSHDONGLES * NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE)
+
+//  Default stack size of each push thread in memory budget mode (KB)
+#define DEFAULT_PUSH_STACK_KB 256
+
+//  Default size of the content arena in memory budget mode (KB)
+#define DEFAULT_CONTENT_ARENA_KB 64
+
+//  Default number of malloc arenas in memory budget mode
+#define DEFAULT_MALLOC_ARENA_MAX 1
+
+//  Alignment of each allocation from a memory arena
+#define ARENA_ALIGN 16
+
+//  Interval of the Timeout cleaner (ms)
+#define CLEANER_INTERVAL 100
+
+//  Maximum number of objects of the push profile
+#define MAX_PUSH_OBJECTS 8
+
+//  Maximum number of simulated devices present at the same time
+#define MAX_SIM_DEVICES 4096
+
+//  Interval between two batches of simulated inquiry results (ms)
+#define LOADGEN_TICK 100
+
+//  Width of each bucket of the push latency histogram (ms)
+#define LATENCY_BUCKET 100
+
+//  Number of buckets of the push latency histogram
+#define LATENCY_BUCKETS 1200
+
+//  First byte of the address of every simulated device
+#define SIM_ADDR_MARK 0x5A
+
+//  Maximum number of rules of each Class of Device list
+#define MAX_COD_RULES 8
+
+//  Size of the cache of devices rejected by Class of Device
+#define COD_CACHE_SIZE 64
+
+//  Default time a rejected device stays in the cache (ms)
+#define DEFAULT_COD_REJECT_TIMEOUT 60000
+
+//  Rule matching any minor class
+#define COD_ANY_MINOR -1
+
+//  Number of major device classes
+#define COD_MAJOR_CLASSES 32
+
+//  Version of the ZigBee frame format
+#define PACKET_VERSION 1
+
+//  Size of the payload of one ZigBee frame
+#define PACKET_DATA_SIZE 64
+
+//  Size of the header in front of the payload of a ZigBee frame
+#define PACKET_HEADER_SIZE offsetof(struct Packet, data)
+
+//  Maximum number of ZigBee frames of one message
+#define PACKET_MAX_FRAGMENTS 8
+
+//  Maximum size of one message sent over ZigBee
+#define PACKET_MAX_MESSAGE (PACKET_DATA_SIZE * PACKET_MAX_FRAGMENTS)
+
+//  Number of messages reassembled at the same time
+#define REASSEMBLY_SLOTS 4
+
+//  Time to wait for the missing frames of a message (ms)
+#define REASSEMBLY_TIMEOUT 5000
+
+//  Number of senders whose last sequence number is remembered
+#define PACKET_SENDERS 4
+
+//  Length of each phase of the codec benchmark (ms)
+#define CODEC_BENCH_TIME 1000
+
+//  Commands between Gateway and Lbeacon
+#define CMD_SWITCH 's'
+#define CMD_HEALTH 'r'
+#define CMD_HEALTH_REPLY 'v'
+#define CMD_BIND 'b'
+#define CMD_HEARTBEAT 'h'
+#define CMD_ANALYTICS 'a'
+#define CMD_SUPPRESS_DELTA 'd'
+#define CMD_SUPPRESS_FILTER 'f'
+
+//  Maximum number of gateways in the ranked gateway list
+#define MAX_GATEWAYS 8
+
+//  Number of messages kept for the gateway while it is unreachable
+#define OUTBOX_SIZE 8
+
+//  Default number of missed heartbeats before failing over
+#define DEFAULT_HEARTBEAT_MISSES 3
+
+//  Startup steps, run at the same time by "@fn startup_begin"
+#define STEP_ADVERTISE 0
+#define STEP_SCAN 1
+#define STEP_PUSH 2
+#define STEP_ZIGBEE 3
+#define STEP_CONTENT 4
+#define STEP_DEDUP 5
+#define STARTUP_STEPS 6
+
+//  Steps which scanning waits for
+#define SCAN_NEEDS \
+  (1 << STEP_SCAN | 1 << STEP_PUSH | 1 << STEP_CONTENT | 1 << STEP_DEDUP)
+
+//  State of a startup step
+#define STEP_PENDING 0
+#define STEP_RUNNING 1
+#define STEP_DONE 2
+#define STEP_FAILED 3
+#define STEP_TIMED_OUT 4
+#define STEP_SKIPPED 5
+
+//  File keeping the recently pushed devices across restarts
+#define DEDUP_STATE_FILE "dedup.state"
+
+//  Interval between two saves of the recently pushed devices (ms)
+#define DEDUP_SAVE_INTERVAL 10000
+
+//  Maximum number of trace ring buffers, one per live thread
+#define TRACE_MAX_RINGS 64
+
+//  Default number of trace events kept by each thread
+#define DEFAULT_TRACE_EVENTS 1024
+
+//  Trace rings in the trace arena of budget mode: the push threads, the
+//  Scan dongle threads and the main, cleaner, gateway and adapter
+//  threads. Other threads fall back to the heap.
+#define TRACE_ARENA_RINGS (PUSH_SLOTS + MAX_SCAN_DONGLES + 4)
+
+//  Default file the trace is exported to
+#define DEFAULT_TRACE_FILE "trace.json"
+
+//  Version of the presence sketch sent to the gateway
+#define ANALYTICS_VERSION 1
+
+//  HyperLogLog of 2^8 registers of 4 bits, about 6.5% error
+#define HLL_PRECISION 8
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define HLL_MAX_RANK 15
+
+//  Devices whose visit is followed at the same time
+#define ANALYTICS_DEVICES 256
+
+//  A visit ends after a device is not seen for this long (ms)
+#define ANALYTICS_ABSENCE 60000
+
+//  Dwell time histogram buckets, upper bounds in seconds
+#define DWELL_BUCKETS 8
+
+//  Default length of an analytics window (s)
+#define DEFAULT_ANALYTICS_WINDOW 0
+
+//  Devices seen within this time are returning (ms), two generations
+#define ANALYTICS_HISTORY 86400000LL
+
+//  Default unique devices expected in a day, which size the Bloom
+//  filter of devices seen before for RETURN_FILTER_FP_RATE
+#define DEFAULT_ANALYTICS_DAILY_DEVICES 5000
+#define RETURN_FILTER_FP_RATE 1.0
+#define RETURN_FILTER_MAX_BITS (1 << 23)
+
+//  Expected false positive rate (%) from which the filter is saturated
+//  and visits are no longer told new or returning
+#define RETURN_FILTER_SATURATED 10.0
+
+//  Bytes of the salt hashed with each address
+#define ANALYTICS_SALT_SIZE 16
+
+//  Default serial device and baud rate of the XBee
+#define DEFAULT_ZIGBEE_DEVICE "/dev/ttyUSB0"
+#define DEFAULT_ZIGBEE_BAUD 9600
+
+//  XBee API frames (AP=1) spoken by the gateway simulator
+#define XBEE_START 0x7E
+#define XBEE_AT_COMMAND 0x08
+#define XBEE_TX_REQUEST 0x10
+#define XBEE_AT_RESPONSE 0x88
+#define XBEE_TX_STATUS 0x8B
+#define XBEE_RX_PACKET 0x90
+#define XBEE_MAX_FRAME 256
+
+//  Time a simulated gateway request waits for its reply (ms)
+#define GWSIM_TIMEOUT 2000
+
+//  Requests of the gateway simulator waiting for a reply
+#define GWSIM_MAX_WINDOW 64
+
+//  Round-trip histogram of the gateway simulator, 1 ms buckets
+#define GWSIM_RTT_BUCKETS GWSIM_TIMEOUT
+
+//  Heartbeat period (ms) of a simulated outage when none is configured
+#define GWSIM_HEARTBEAT 1000
+
+//  Version of the push suppression messages
+#define SUPPRESS_VERSION 1
+
+//  Largest pushed-device filter, so a snapshot fits in one message
+#define SUPPRESS_HEADER_SIZE 5
+#define SUPPRESS_MAX_BYTES (PACKET_MAX_MESSAGE - SUPPRESS_HEADER_SIZE)
+#define SUPPRESS_MAX_BITS (SUPPRESS_MAX_BYTES * 8)
+
+//  Pushed devices sent in one delta, 8 byte hashes in 64 bytes
+#define SUPPRESS_DELTA_MAX 7
+
+//  Interval between two delta updates to the gateway (ms)
+#define SUPPRESS_PUBLISH_INTERVAL 5000
+
+//  Default target false positive rate (%) and pushes per generation
+#define DEFAULT_SUPPRESS_FP_RATE 1.0
+#define DEFAULT_SUPPRESS_CAPACITY 256
+
+//  Duration of a trace event which is an instant or names its thread
+#define TRACE_INSTANT_DUR -1
+#define TRACE_THREAD_NAME -2
+
+//  Trace macros cost one load and branch while tracing is off
+#define TRACE_NOW() (trace_enabled ? trace_now() : 0)
+#define TRACE_INSTANT(name, addr, arg)                                      \
+  do {                                                                      \
+    if (trace_enabled)                                                      \
+      trace_event(name, addr, trace_now(), TRACE_INSTANT_DUR, arg);         \
+  } while (0)
+#define TRACE_INSTANT_BDADDR(name, bdaddr, arg)                             \
+  do {                                                                      \
+    if (trace_enabled)                                                      \
+      trace_event_bdaddr(name, bdaddr, trace_now(), TRACE_INSTANT_DUR, arg); \
+  } while (0)
+#define TRACE_SPAN(name, addr, start, arg)                                  \
+  do {                                                                      \
+    if (trace_enabled && (start) > 0)                                       \
+      trace_event(name, addr, start, trace_now() - (start), arg);           \
+  } while (0)
+#define TRACE_SPAN_BDADDR(name, bdaddr, start, arg)                         \
+  do {                                                                      \
+    if (trace_enabled && (start) > 0)                                       \
+      trace_event_bdaddr(name, bdaddr, start, trace_now() - (start), arg);  \
+  } while (0)
+
 //  The interval time of same user object push
 const long long Timeout = 20000;
 
@@ -117,7 +411,7 @@ char addrbufferlist[PUSHDONGLES * NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE][18] = {
 char* filepath;
 
 //  HCI command for BLE beacon
-char BLE_coordinate_cmd[100];
+char BLE_coordinate_cmd[200];
 
 //  List of threads is idle or not
 int IdleHandler[PUSHDONGLES * NUMBER_OF_DEVICE_IN_EACH_PUSHDONGLE] = {0};
@@ -151,12 +445,33 @@ union {
  * STRUCTS
  */
 
-//  Packet format transmitted via ZigBee
-//  |1byte|5bytes|2bytes|2byte|64bytes|
+//  Packet format transmitted via ZigBee, one frame of a message.
+//  Only data_len bytes of data are sent.
+//  |1byte|1byte  |2bytes|1byte     |1byte     |1byte   |2bytes|0-64bytes|
+//  |CMD  |version|seq   |frag_index|frag_count|data_len|crc   |data     |
 struct Packet {
-  unsigned char CMD;  //   --1 byte
-  unsigned char verify_code[16];
-  unsigned char data[64];  //--64 bytes
+  unsigned char CMD;         //  command of the message
+  unsigned char version;     //  PACKET_VERSION
+  unsigned char seq[2];      //  sequence number of the message
+  unsigned char frag_index;  //  index of this frame in the message
+  unsigned char frag_count;  //  number of frames of the message
+  unsigned char data_len;    //  length of data in this frame
+  unsigned char crc[2];      //  CRC-16/CCITT of header and data
+  unsigned char data[PACKET_DATA_SIZE];
+};
+
+//  Presence of one analytics window, as sent to the gateway. Sketches
+//  of many beacons or windows merge by taking the larger register and
+//  adding the counts, see "@fn analytics_merge". Numbers are big endian.
+struct AnalyticsSketch {
+  unsigned char version;           //  ANALYTICS_VERSION
+  unsigned char precision;         //  HLL_PRECISION
+  unsigned char window_end[4];     //  end of the window, unix time (s)
+  unsigned char window_len[2];     //  length of the window (s)
+  unsigned char visits_new[2];     //  visits of devices not seen before
+  unsigned char visits_returning[2];
+  unsigned char dwell[DWELL_BUCKETS][2];  //  visits ended, by dwell time
+  unsigned char registers[HLL_REGISTERS / 2];  //  two 4 bit registers
 };
 
 //  Config parameters
@@ -167,12 +482,74 @@ struct config {
   char coordinate_Y[MAXBUF];
   char level[MAXBUF];
   char RSSI_Coverage[MAXBUF];
+  char memory_budget[MAXBUF];
+  char push_stack_kb[MAXBUF];
+  char content_arena_kb[MAXBUF];
+  char malloc_arena_max[MAXBUF];
+  char scan_dongles[MAXBUF];
+  char inquiry_phase_offset[MAXBUF];
+  char scan_merge_window[MAXBUF];
+  char cod_allow[MAXBUF];
+  char cod_deny[MAXBUF];
+  char cod_reject_timeout[MAXBUF];
+  char zigbee_legacy[MAXBUF];
+  char gateway_list[MAXBUF];
+  char heartbeat_interval[MAXBUF];
+  char heartbeat_misses[MAXBUF];
+  char adaptive_inquiry[MAXBUF];
+  char inquiry_min_length[MAXBUF];
+  char inquiry_max_length[MAXBUF];
+  char inquiry_max_gap[MAXBUF];
+  char trace_events[MAXBUF];
+  char trace_file[MAXBUF];
+  char analytics_window[MAXBUF];
+  char analytics_salt[MAXBUF];
+  char suppress_time[MAXBUF];
+  char suppress_fp_rate[MAXBUF];
+  char suppress_capacity[MAXBUF];
+  char zigbee_device[MAXBUF];
+  char zigbee_baud[MAXBUF];
+  char push_profile[MAXBUF];
+  char push_dongles[MAXBUF];
+  char advertise_dongle[MAXBUF];
+  char analytics_daily_devices[MAXBUF];
   int filepath_len;
   int filename_len;
   int coordinate_X_len;
   int coordinate_Y_len;
   int level_len;
   int RSSI_Coverage_len;
+  int memory_budget_len;
+  int push_stack_kb_len;
+  int content_arena_kb_len;
+  int malloc_arena_max_len;
+  int scan_dongles_len;
+  int inquiry_phase_offset_len;
+  int scan_merge_window_len;
+  int cod_allow_len;
+  int cod_deny_len;
+  int cod_reject_timeout_len;
+  int zigbee_legacy_len;
+  int gateway_list_len;
+  int heartbeat_interval_len;
+  int heartbeat_misses_len;
+  int adaptive_inquiry_len;
+  int inquiry_min_length_len;
+  int inquiry_max_length_len;
+  int inquiry_max_gap_len;
+  int trace_events_len;
+  int trace_file_len;
+  int analytics_window_len;
+  int analytics_salt_len;
+  int suppress_time_len;
+  int suppress_fp_rate_len;
+  int suppress_capacity_len;
+  int zigbee_device_len;
+  int zigbee_baud_len;
+  int push_profile_len;
+  int push_dongles_len;
+  int advertise_dongle_len;
+  int analytics_daily_devices_len;
 };
 
 /*********************************************************************
@@ -183,9 +560,20 @@ typedef struct {
   char addr[18];
   int threadId;
   pthread_t t;
+  int joinable;
 
 } Threadaddr;
 
+//  Fixed size memory region allocated up front, handed out by bumping
+typedef struct {
+  const char* name;
+  unsigned char* base;
+  size_t size;
+  size_t used;
+  int failed;
+
+} MemArena;
+
 typedef struct {
   long long DeviceAppearTime[MAX_OF_DEVICE];
   char DeviceAppearAddr[MAX_OF_DEVICE][18];
@@ -205,12 +593,701 @@ DeviceQueue UsedDeviceQueue;
 int ZigBee_addr_Scan_count = 0;
 struct xbee_conAddress Gatewayaddr;
 
+//  Memory budget mode: preallocate arenas and bound thread stacks
+int memory_budget_mode = 0;
+
+//  Stack size of each push thread, 0 for the system default
+size_t push_stack_size = 0;
+
+//  Arena of the push thread stacks, one stack per push slot
+MemArena stack_arena = {"push stacks"};
+
+//  Arena of the object push content and its path
+MemArena content_arena = {"content"};
+
+//  Arena of the trace rings, mapped when tracing first starts
+MemArena trace_arena = {"trace"};
+
+//  Arena of the return filter of presence analytics
+MemArena analytics_arena = {"analytics"};
+
+//  Object of the push profile, the objects are sent back to back in
+//  one OBEX session
+typedef struct {
+  char* path;
+  const char* name;     //  name sent to the device, basename of path
+  unsigned char* data;  //  content preloaded into the content arena
+  int size;             //  bytes, known at startup
+  long long sent;
+  long long failed;
+  long long put_time;   //  ms of all puts of the object
+
+} PushObject;
+
+//  Push profile, the object push file unless Push_Profile lists others
+PushObject push_objects[MAX_PUSH_OBJECTS];
+int push_object_count = 0;
+
+//  OBEX sessions: setup is SDP browse, open and connect, teardown is
+//  disconnect and close, both paid once for all objects
+long long push_sessions = 0;
+long long push_sessions_failed = 0;
+long long push_setup_time = 0;
+long long push_teardown_time = 0;
+long long push_objects_sent = 0;
+pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Heap bytes in use when the beacon finished startup
+size_t heap_in_use_at_start = 0;
+
+//  Set by SIGUSR1, the cleaner thread prints the status report
+volatile sig_atomic_t report_requested = 0;
+
+//  Inquiry parameters of a Scan dongle and the effect of each decision
+typedef struct {
+  int length;   //  inquiry length, units of 1.28 s
+  int num_rsp;  //  responses which end the inquiry, 0 for unlimited
+  int gap;      //  pause after the inquiry (ms)
+  int last_decision;
+  double new_rate;  //  moving average of new devices per second
+  long long cycle_start;
+  long long new_mark;
+  long long returning_mark;
+  long long push_mark;
+  long long miss_mark;
+  long long decisions[INQUIRY_DECISIONS];
+  long long decision_new[INQUIRY_DECISIONS];
+  long long decision_pushes[INQUIRY_DECISIONS];
+  double decision_seconds[INQUIRY_DECISIONS];
+
+} InquirySchedule;
+
+//  Scan dongle with its own reader thread and statistics, its device
+//  ID is kept by the adapter manager
+typedef struct {
+  int index;
+  int phase_offset;
+  pthread_t t;
+  long long start_time;
+  long long inquiries;
+  long long failures;
+  long long results;
+  long long new_devices;
+  long long returning;
+  long long best_rssi_updates;
+  InquirySchedule schedule;
+
+} ScanAdapter;
+
+//  Device in the merged result stream of all Scan dongles
+typedef struct {
+  bdaddr_t bdaddr;
+  int best_rssi;
+  int adapter;
+  long long first_seen;
+  long long last_seen;
+  char used;
+  char dispatched;
+  long long suppressed;   //  time a neighbour's push suppressed the device
+  long long trace_gated;  //  trace time the device passed the RSSI gate
+
+} ScannedDevice;
+
+ScanAdapter scan_adapters[MAX_SCAN_DONGLES];
+int scan_adapter_count = 0;
+
+//  Adapter of a role, bound to a device ID or to the address of the
+//  adapter, whatever device ID it comes back with
+typedef struct {
+  int role;
+  int index;           //  Scan dongle or Push dongle of the role
+  char by_address;
+  bdaddr_t bdaddr;
+  int dev_id;          //  current device ID, -1 while it is missing
+  char up;
+  long long changed;   //  time it last went up or down
+  long long downs;
+  long long recoveries;
+  long long recovery_ms;  //  last time from up to the role running
+
+} AdapterRole;
+
+//  Source of adapter events and state, so hot-plug can run on a stand-in
+typedef struct {
+  const char* name;
+  int (*open)();
+  //  1: HCI_DEV_* event of dev_id, 0: other event, -1: error
+  int (*read)(int fd, int* event, int* dev_id);
+  int (*info)(int dev_id, bdaddr_t* bdaddr, int* up);
+  int (*up)(int dev_id);
+
+} AdapterBackend;
+
+//  Stand-in adapter of the load test
+typedef struct {
+  char used;
+  char up;
+  bdaddr_t bdaddr;
+
+} SimAdapter;
+
+AdapterRole adapter_roles[MAX_ADAPTER_ROLES];
+int adapter_role_count = 0;
+
+//  Backend of the adapter manager, the HCI stack unless load testing
+AdapterBackend* adapter_backend;
+
+//  Adapter events handled, pushes failed by their Push dongle, and push
+//  jobs not given to a Push dongle which is down
+long long adapter_events = 0;
+long long push_adapter_failures = 0;
+long long push_slots_down = 0;
+
+//  Serialize the roles, signalled when an adapter comes up
+pthread_mutex_t adapter_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t adapter_cond = PTHREAD_COND_INITIALIZER;
+
+//  Stand-in adapters and the pipe carrying their events
+SimAdapter sim_adapters[HCI_MAX_DEV];
+int sim_adapter_pipe[2] = {-1, -1};
+
+//  Merged results, kept for scan_merge_window ms after last seen
+ScannedDevice scanned_devices[MAX_SCANNED_DEVICE];
+long long scan_merge_window = DEFAULT_MERGE_WINDOW;
+long long scan_merged_unique = 0;
+
+//  Serialize the merged stream, the dispatch to push dongles and the
+//  queue of devices pushed recently
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Number of push threads started, and of devices finding no idle slot
+long long pushes_started = 0;
+long long push_slot_misses = 0;
+
+//  Adapt inquiry length, gap and responses to the crowd and push load
+int adaptive_inquiry = 0;
+int inquiry_min_length = DEFAULT_INQUIRY_MIN_LENGTH;
+int inquiry_max_length = INQUIRY_LENGTH;
+int inquiry_max_gap = DEFAULT_INQUIRY_MAX_GAP;
+
+//  Rule on the major and minor class of a Class of Device
+typedef struct {
+  int major;
+  int minor;
+
+} CodRule;
+
+//  Device rejected by its Class of Device
+typedef struct {
+  bdaddr_t bdaddr;
+  long long expire;
+
+} CodRejected;
+
+//  Allow and deny rules, deny wins and an empty allow list allows all
+CodRule cod_allow[MAX_COD_RULES];
+CodRule cod_deny[MAX_COD_RULES];
+int cod_allow_count = 0;
+int cod_deny_count = 0;
+
+//  Short-lived cache of rejected devices
+CodRejected cod_cache[COD_CACHE_SIZE];
+long long cod_reject_timeout = DEFAULT_COD_REJECT_TIMEOUT;
+
+//  Statistics of the Class of Device filter
+long long cod_accepted = 0;
+long long cod_cache_hits = 0;
+long long cod_rejected[COD_MAJOR_CLASSES];
+long long cod_rejected_in_range = 0;
+pthread_mutex_t cod_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Total time push slots were held by push threads (ms)
+long long push_slot_time = 0;
+long long push_slot_uses = 0;
+
+//  Sender and framing of a received message
+typedef struct {
+  struct xbee_conAddress address;
+  int version;  //  0 for a legacy unframed command
+  unsigned int seq;
+
+} PacketContext;
+
+//  Handler of a command received from the gateway
+typedef void (*PacketHandler)(PacketContext* ctx,
+                              unsigned char* data,
+                              int len);
+
+//  Message being reassembled from its frames
+typedef struct {
+  unsigned char addr64[8];
+  unsigned int seq;
+  unsigned char cmd;
+  int frag_count;
+  unsigned int received;
+  int length;
+  long long started;
+  char used;
+  unsigned char data[PACKET_MAX_MESSAGE];
+
+} Reassembly;
+
+//  Last message delivered from a sender, to drop duplicates
+typedef struct {
+  unsigned char addr64[8];
+  unsigned int seq;
+  char used;
+
+} PacketSender;
+
+//  Statistics of the ZigBee codec
+typedef struct {
+  long long frames;
+  long long legacy;
+  long long bad_length;
+  long long bad_version;
+  long long bad_crc;
+  long long fragments;
+  long long messages;
+  long long duplicates;
+  long long timeouts;
+  long long unknown;
+  long long sent_frames;
+  long long sent_messages;
+  long long send_errors;
+
+} PacketStats;
+
+Reassembly reassembly[REASSEMBLY_SLOTS];
+PacketSender packet_senders[PACKET_SENDERS];
+PacketStats packet_stats;
+
+//  Accept unframed single byte commands of older gateways
+int zigbee_legacy = 1;
+
+//  Sequence number of the next message sent to the gateway
+unsigned int packet_tx_seq = 0;
+
+//  Serialize received frames
+pthread_mutex_t packet_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Message waiting for the gateway to come back
+typedef struct {
+  unsigned char cmd;
+  int len;
+  unsigned char data[PACKET_MAX_MESSAGE];
+
+} OutboxEntry;
+
+//  Known gateway, in order of preference
+typedef struct {
+  unsigned char addr64[8];
+  long long last_rx;
+  int failures;
+
+} GatewayEntry;
+
+GatewayEntry gateways[MAX_GATEWAYS];
+int gateway_count = 0;
+
+//  Gateways read from Gateway_List, the first of the list. When a list
+//  is configured, no other gateway is bound.
+int gateway_listed = 0;
+
+//  Index of the bound gateway in the list, -1 when none
+int gateway_current = -1;
+
+//  Index of the gateway bound or tried last
+int gateway_attempt = -1;
+
+//  Heartbeat period (ms), 0 disables heartbeat and failover
+long long heartbeat_interval = 0;
+int heartbeat_misses = DEFAULT_HEARTBEAT_MISSES;
+int gateway_missed = 0;
+
+//  Failover in progress since this time, 0 when none
+long long failover_started = 0;
+long long failovers = 0;
+long long recoveries = 0;
+long long recover_last = 0;
+long long recover_max = 0;
+long long recover_total = 0;
+
+//  Messages kept while the gateway is unreachable, oldest first
+OutboxEntry outbox[OUTBOX_SIZE];
+int outbox_first = 0;
+int outbox_count = 0;
+long long outbox_dropped = 0;
+long long outbox_resent = 0;
+
+//  Serialize g_con, the gateway state, the outbox and sending
+pthread_mutex_t gateway_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Steps of an object push, so the push can run on a stand-in
+typedef struct {
+  const char* name;
+  int (*attach)(int dev_id);
+  void (*detach)(int handle);
+  int (*browse)(const char* address);
+  void* (*open)();
+  int (*connect)(void* cli, const char* address, int channel);
+  int (*put)(void* cli,
+             const char* path,
+             const unsigned char* data,
+             int size,
+             const char* name);
+  int (*disconnect)(void* cli);
+  void (*close)(void* cli);
+  void (*finished)(const char* address, int result);
+
+} PushTransport;
+
+//  Transport of "@fn send_file", obexftp unless the load generator runs
+PushTransport* push_transport;
+
+//  Population model of the load generator
+typedef struct {
+  int arrival_rate;  //  devices per minute
+  int dwell;         //  mean dwell time (s)
+  int rssi;          //  mean RSSI on arrival
+  int rssi_step;     //  maximum RSSI change per inquiry result
+  int no_opp;        //  % of devices without Object Push
+  int repeat;        //  % of arrivals which visited before
+  int seen;          //  mean interval between two results of a device (ms)
+  int duration;      //  length of the test (s)
+  int browse_ms;     //  time of each step of the stand-in push
+  int connect_ms;
+  int put_ms;
+  int outage;        //  a Push dongle drops off every outage s, 0 never
+  int outage_ms;     //  length of each outage
+
+} LoadModel;
+
+//  Device of the load generator population
+typedef struct {
+  unsigned int id;
+  long long arrival;
+  long long departure;
+  long long in_range_since;
+  int rssi;
+  char used;
+  char pushing;
+  char pushed;
+
+} SimDevice;
+
+//  Results of a load test
+typedef struct {
+  long long arrivals;
+  long long repeats;
+  long long no_opp;
+  long long departures;
+  long long results;
+  long long parse_us;
+  long long pushes_started;
+  long long pushes_ok;
+  long long pushes_failed;
+  long long dropped;
+  long long outages;
+  int waiting_max;
+  int waiting_first;
+  int waiting_last;
+  int latency[LATENCY_BUCKETS + 1];
+
+} LoadStats;
+
+LoadModel load_model = {500,  60, -55, 4, 20, 10, 2000, 300, 1200, 2000,
+                        1500, 0,  DEFAULT_OUTAGE_LENGTH};
+LoadStats load_stats;
+SimDevice sim_devices[MAX_SIM_DEVICES];
+unsigned int sim_next_id = 0;
+
+//  Serialize the population and the results of the load test
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Initialization step run in its own thread at startup
+typedef struct {
+  const char* name;
+  int (*run)();   //  returns 0 on success
+  int timeout;    //  ms until the step is given up
+  int hardware;   //  skipped by the load test
+  int state;
+  int late;       //  finished after its timeout
+  long long start;
+  long long end;
+  pthread_t t;
+
+} StartupStep;
+
+//  Startup steps, indexed by STEP_*
+StartupStep startup_steps[STARTUP_STEPS];
+
+//  Time LBeacon started, and the end of each startup phase (ms)
+long long startup_time = 0;
+long long startup_config_done = 0;
+long long startup_scanning = 0;
+long long startup_done = 0;
+
+//  Signal the end of each startup step
+pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+//  Recently pushed devices are saved here, NULL to keep them in memory
+char* dedup_state_file = DEDUP_STATE_FILE;
+
+//  The recently pushed devices changed since the last save
+int dedup_dirty = 0;
+
+//  Visit of a device, known only by the hash of its address
+typedef struct {
+  unsigned long long hash;
+  long long first_seen;
+  long long last_seen;
+  char used;
+
+} PresenceVisit;
+
+//  Length of an analytics window (ms), 0 disables analytics
+long long analytics_window = DEFAULT_ANALYTICS_WINDOW * 1000LL;
+
+//  Salt of the address hash, the same on every beacon of a site, and
+//  whether one is configured
+unsigned char analytics_salt[ANALYTICS_SALT_SIZE];
+int analytics_salted = 0;
+
+//  Unique devices of this window and since start
+unsigned char analytics_registers[HLL_REGISTERS / 2];
+unsigned char analytics_total_registers[HLL_REGISTERS / 2];
+
+PresenceVisit presence_visits[ANALYTICS_DEVICES];
+unsigned int dwell_histogram[DWELL_BUCKETS];
+unsigned int visits_new = 0;
+unsigned int visits_returning = 0;
+unsigned int visits_unclassified = 0;
+const int dwell_bounds[DWELL_BUCKETS] = {30, 60, 120, 300, 600, 1800, 3600,
+                                         INT_MAX};
+
+//  Devices seen in this and the last ANALYTICS_HISTORY, sized for the
+//  unique devices expected in a day, with the bits set of each
+unsigned char* return_filter[2] = {NULL, NULL};
+int return_filter_bits = 0;
+int return_filter_hashes = 0;
+int return_filter_set[2] = {0, 0};
+long long return_filter_rotated = 0;
+
+long long analytics_window_start = 0;
+long long sketches_sent = 0;
+long long analytics_results = 0;
+
+//  Serialize the analytics of all Scan dongles
+pthread_mutex_t analytics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Devices pushed by neighbour LBeacons are not pushed again for this
+//  long (ms), 0 disables push suppression
+long long suppress_time = 0;
+
+//  Size of the pushed-device filters, from the target false positive
+//  rate and the pushes expected in one generation of suppress_time / 2
+double suppress_fp_rate = DEFAULT_SUPPRESS_FP_RATE;
+int suppress_capacity = DEFAULT_SUPPRESS_CAPACITY;
+int suppress_bits = 0;
+int suppress_hashes = 0;
+
+//  Two generations of the devices pushed here, and of those pushed by
+//  the neighbours. The older generation is dropped every
+//  suppress_time / 2, so an entry lives between one and two halves.
+unsigned char local_filter[2][SUPPRESS_MAX_BYTES];
+unsigned char neighbour_index[2][SUPPRESS_MAX_BYTES];
+long long suppress_rotated = 0;
+
+//  Pushes not yet sent to the gateway
+unsigned long long suppress_pending[SUPPRESS_DELTA_MAX];
+int suppress_pending_count = 0;
+long long suppress_published = 0;
+
+//  Statistics of push suppression
+long long suppressed_pushes = 0;
+long long suppress_deltas_sent = 0;
+long long suppress_filters_sent = 0;
+long long suppress_deltas_received = 0;
+long long suppress_filters_received = 0;
+long long suppress_filters_mismatched = 0;
+
+//  Serialize the pushed-device filters
+pthread_mutex_t suppress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Serial device and baud rate of the XBee
+char zigbee_device[MAXBUF] = DEFAULT_ZIGBEE_DEVICE;
+int zigbee_baud = DEFAULT_ZIGBEE_BAUD;
+
+//  Script of the gateway simulator
+typedef struct {
+  int rate;          //  health requests per second, 0 as fast as window
+  int window;        //  health requests waiting for a reply at most
+  int duration;      //  length of the benchmark (s)
+  int loss;          //  % of frames lost in each direction
+  int content;       //  bytes of each content ('s') message, 0 for none
+  int content_rate;  //  content messages per second
+  int baud;          //  serial speed emulated, 0 for none
+  int outage;        //  primary gateway goes silent after this (s), 0 never
+  int outage_len;    //  length of the outage (s), 0 until the end
+  int backup;        //  1 to simulate a backup gateway
+
+} GatewaySimModel;
+
+//  Health request of the gateway simulator waiting for its reply
+typedef struct {
+  unsigned int token;
+  long long sent;  //  us of "@fn trace_now"
+  char used;
+
+} GatewaySimRequest;
+
+//  Results of the gateway simulator
+typedef struct {
+  long long requests;
+  long long replies;
+  long long lost;
+  long long late;
+  long long content;
+  long long frames_out;
+  long long frames_in;
+  long long dropped_out;
+  long long dropped_in;
+  long long outage_dropped;  //  frames to or from a gateway which is down
+  long long bytes_out;
+  long long bytes_in;
+  long long at_commands;
+  long long heartbeats;
+  long long other;
+  long long bad_frames;
+  long long rtt_total;  //  us
+  long long rtt_max;
+  int rtt[GWSIM_RTT_BUCKETS + 1];
+
+} GatewaySimStats;
+
+GatewaySimModel gwsim_model = {0, 1, 30, 0, 0, 0, DEFAULT_ZIGBEE_BAUD,
+                               0, 0, 0};
+GatewaySimStats gwsim_stats;
+GatewaySimRequest gwsim_requests[GWSIM_MAX_WINDOW];
+int gwsim_fd = -1;
+unsigned int gwsim_seq = 0;
+
+//  Addresses of the simulated primary and backup gateway
+unsigned char gwsim_addr64[2][8] = {
+    {0x00, 0x13, 0xA2, 0x00, 0x40, 0x00, 0x00, 0x01},
+    {0x00, 0x13, 0xA2, 0x00, 0x40, 0x00, 0x00, 0x02}};
+
+//  Start of the benchmark (us of "@fn trace_now"), and the simulated
+//  gateway LBeacon sent to last, which sends the requests
+long long gwsim_start = 0;
+int gwsim_active = 0;
+
+//  Serialize the simulator's writes to the pty and its statistics
+pthread_mutex_t gwsim_write_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t gwsim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  Timestamped span or instant of a device's lifecycle
+typedef struct {
+  const char* name;
+  char addr[18];      //  Bluetooth address, or the name of the thread
+  int tid;
+  int arg;
+  long long ts;       //  us of the monotonic clock
+  long long dur;      //  us, or TRACE_INSTANT_DUR / TRACE_THREAD_NAME
+
+} TraceEvent;
+
+//  Trace events of one thread, the oldest overwritten when full
+typedef struct {
+  TraceEvent* events;
+  unsigned long long head;  //  events written
+  int in_use;               //  a live thread writes to it
+
+} TraceRing;
+
+//  Record trace events, toggled by SIGUSR2 or "-T"
+volatile int trace_enabled = 0;
+volatile sig_atomic_t trace_toggle_requested = 0;
+
+TraceRing trace_rings[TRACE_MAX_RINGS];
+int trace_ring_count = 0;
+int trace_ring_size = DEFAULT_TRACE_EVENTS;
+char trace_file[MAXBUF] = DEFAULT_TRACE_FILE;
+
+//  Trace time when tracing started, and events lost for want of a ring
+long long trace_epoch = 0;
+long long trace_dropped = 0;
+
+//  Ring of each thread, released when the thread exits
+pthread_key_t trace_key;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*********************************************************************
  * FUNCTIONS
  */
 
 //  Parse the packet and execute from gateway
-void parse_packet(unsigned char* packet, struct xbee_conAddress address);
+void parse_packet(unsigned char* packet,
+                  int len,
+                  struct xbee_conAddress address);
+
+//  CRC-16/CCITT used by the ZigBee frames
+unsigned short packet_crc(unsigned short crc,
+                          const unsigned char* data,
+                          int len);
+
+//  Build one ZigBee frame in place
+int packet_encode(struct Packet* frame,
+                  unsigned char cmd,
+                  unsigned int seq,
+                  int frag_index,
+                  int frag_count,
+                  const unsigned char* data,
+                  int len);
+
+//  Check a received ZigBee frame in place
+struct Packet* packet_decode(unsigned char* buf, int len);
+
+//  Reassemble, deduplicate and dispatch a received ZigBee frame
+void packet_receive(PacketHandler* handlers,
+                    unsigned char* buf,
+                    int len,
+                    struct xbee_conAddress* address);
+
+//  Send a message to the gateway, in as many frames as needed
+int zigbee_send(unsigned char cmd, const unsigned char* data, int len);
+
+//  Frame and send a message on a connection
+int zigbee_transmit(struct xbee_con* target,
+                    unsigned char cmd,
+                    const unsigned char* data,
+                    int len);
+
+//  Note a frame received from a gateway
+void gateway_heard(struct xbee_conAddress* address);
+
+//  Read the ranked gateway list and heartbeat settings from config
+void gateway_init(struct config* cfg);
+
+//  Thread sending heartbeats and failing over to the next gateway
+void* gateway_monitor(void* ptr);
+
+//  Print the state of the gateway connection
+void gateway_report();
+
+//  Answer a received message in the framing it came in
+int zigbee_reply(PacketContext* ctx,
+                 unsigned char cmd,
+                 const unsigned char* data,
+                 int len);
+
+//  Print the statistics of the ZigBee codec
+void zigbee_report();
+
+//  Fuzz and throughput benchmark of the ZigBee codec
+int packet_benchmark();
 
 //  error handler
 void error(char* msg);
@@ -228,10 +1305,66 @@ int addr_status_check(char addr[]);
 static void print_result(bdaddr_t* bdaddr, char has_rssi, int rssi);
 
 //  Send scanded user address to push dongle
-static void sendToPushDongle(bdaddr_t* bdaddr, char has_rssi, int rssi);
+static int sendToPushDongle(bdaddr_t* bdaddr, char has_rssi, int rssi);
+
+//  Check the Class of Device of a scanned device
+int cod_filter_accept(bdaddr_t* bdaddr, uint8_t dev_class[3], int rssi);
+
+//  Read the Class of Device rules from config
+void cod_filter_init(struct config* cfg);
+
+//  Print the statistics of the Class of Device filter
+void cod_report();
+
+//  Merge a result of a Scan dongle into the deduplicated stream
+void scan_merge_result(ScanAdapter* adapter, bdaddr_t* bdaddr, int rssi);
+
+//  Parse an HCI event of a Scan dongle
+int scanner_process_event(ScanAdapter* adapter, unsigned char* buf, int len);
 
 //  Start scanning bluetooth device
-static void scanner_start();
+static int scanner_start(ScanAdapter* adapter, int dev_id);
+
+//  Thread of a Scan dongle, repeats inquiry
+void* scanner_thread(void* ptr);
+
+//  Start the inquiry schedule of a Scan dongle
+void inquiry_schedule_start(ScanAdapter* adapter);
+
+//  Choose the next inquiry parameters after an inquiry
+void inquiry_schedule_update(ScanAdapter* adapter, long long duration);
+
+//  Print the inquiry schedule of each Scan dongle
+void inquiry_report();
+
+//  Read the Scan dongles from config
+void scan_adapters_init(struct config* cfg);
+
+//  Print statistics of each Scan dongle
+void scan_report();
+
+//  Read the Push dongles and advertiser from config, find every
+//  adapter and watch them come and go
+void adapters_init(struct config* cfg);
+
+//  Device ID of the adapter of a role, -1 while it is down
+int adapter_ready(int role, int index);
+
+//  Device ID of the adapter of a role, up or down, -1 while it is
+//  missing
+int adapter_dev_id(int role, int index);
+
+//  Handle an adapter registered, unregistered, up or down
+void adapter_event(int event, int dev_id);
+
+//  Change a stand-in adapter of the load test and report the event
+void sim_adapter_event(int event, int dev_id, bdaddr_t* bdaddr);
+
+//  Forget a device pushed, so it can be pushed again
+void dedup_forget(const char* addr);
+
+//  Print the adapters of each role
+void adapter_report();
 
 //  Prototype for the file sending function
 void* send_file(void* address);
@@ -242,9 +1375,48 @@ void* send_file(void* ptr);
 //  Remove the user ID from pushed list
 void* timeout_cleaner(void);
 
+//  Read the population model of the load generator
+int loadgen_parse(char* options);
+
+//  Run the load generator and print its report
+int loadgen_run();
+
+//  Print the results of the load test
+void loadgen_report(long long elapsed);
+
 //  Read parameter from config file
 struct config get_config(char* filename);
 
+//  Convert an optional config value to integer
+int get_config_int(char value[], int value_len, int default_value);
+
+//  Allocate the memory of an arena up front
+int arena_init(MemArena* arena, size_t size);
+
+//  Take a block from an arena
+void* arena_alloc(MemArena* arena, size_t size);
+
+//  Load an object of the push profile into memory
+int content_preload(PushObject* object);
+
+//  Read the objects of the push profile from config
+int push_profile_init(struct config* cfg);
+
+//  Print the sessions and objects of the push profile
+void push_report();
+
+//  Enter memory budget mode with the sizes from config
+void memory_budget_init(struct config* cfg);
+
+//  Print memory usage of each subsystem
+void memory_report();
+
+//  Print the report of all subsystems
+void print_status_report();
+
+//  SIGUSR1 handler which requests a status report
+void report_signal_handler(int signo);
+
 //  Callback for ZigBee reciver
 void wait_gateway_bindCB(struct xbee* xbee,
                          struct xbee_con* con,
@@ -265,3 +1437,115 @@ int bind_gateway(struct xbee_conAddress address);
 
 //  Initialize the ZigeBee
 int zigbee_init();
+
+//  Save the recently pushed devices
+int dedup_save();
+
+//  Restore the recently pushed devices saved before a restart
+int dedup_restore();
+
+//  Start every startup step in its own thread
+void startup_begin(int load_test);
+
+//  Wait until the given startup steps end or time out
+void startup_wait(int mask);
+
+//  Print the time taken by each startup step
+void startup_report();
+
+//  Send a state such as "READY=1" to the service manager
+int sd_notify_send(const char* state);
+
+//  Read the analytics settings from config
+void analytics_init(struct config* cfg);
+
+//  Salted hash of an address, the only form analytics sees
+unsigned long long analytics_hash(bdaddr_t* bdaddr);
+
+//  Count an inquiry result of a hashed address
+void analytics_observe(unsigned long long hash, long long now);
+
+//  End visits and windows, and send the sketch of each window
+void analytics_tick(long long now);
+
+//  Serialize the current window into a sketch
+void analytics_encode(struct AnalyticsSketch* sketch, long long now);
+
+//  Merge a sketch into another
+void analytics_merge(struct AnalyticsSketch* into,
+                     const struct AnalyticsSketch* from);
+
+//  Estimate the unique devices of HyperLogLog registers
+double hll_estimate(const unsigned char registers[HLL_REGISTERS / 2]);
+
+//  Print the presence analytics
+void analytics_report();
+
+//  Size the pushed-device filters from config
+void suppress_init(struct config* cfg);
+
+//  Check whether a neighbour LBeacon pushed the address recently
+int suppress_check(char addr[]);
+
+//  Add a device pushed here successfully to the filter sent to the
+//  neighbours
+void suppress_pushed(char addr[]);
+
+//  Merge a delta update of a neighbour into the index
+void suppress_merge_delta(unsigned char* data, int len);
+
+//  Merge a filter snapshot of a neighbour into the index
+void suppress_merge_filter(unsigned char* data, int len);
+
+//  Send delta updates and snapshots, and age the filters
+void suppress_tick(long long now);
+
+//  Print the state of push suppression
+void suppress_report();
+
+//  Read the script of the gateway simulator
+int gwsim_parse(char* options);
+
+//  Run LBeacon's ZigBee side against the simulated gateway on a pty
+int gwsim_run();
+
+//  Print the results of the gateway simulator
+void gwsim_report(long long elapsed);
+
+//  Read the trace settings from config
+void trace_init(struct config* cfg);
+
+//  Current time of the trace clock (us)
+long long trace_now();
+
+//  Record a trace event in the ring of the calling thread
+void trace_event(const char* name,
+                 const char* addr,
+                 long long ts,
+                 long long dur,
+                 int arg);
+
+//  Record a trace event of a Bluetooth address
+void trace_event_bdaddr(const char* name,
+                        bdaddr_t* bdaddr,
+                        long long ts,
+                        long long dur,
+                        int arg);
+
+//  Name the calling thread in the trace
+void trace_thread_name(const char* name);
+
+//  Start tracing with empty rings
+void trace_start();
+
+//  Stop tracing and export the trace
+void trace_stop();
+
+//  Write the trace as Chrome trace JSON
+int trace_export(const char* path);
+
+//  Print the state of tracing
+void trace_report();
+
+//  SIGUSR2 handler which requests tracing to be toggled
+void trace_signal_handler(int signo);